@@ -26,6 +26,8 @@ using System.Configuration;
 namespace GoogleEmailUploader {
   public class GoogleEmailUploaderConfig {
     static int maximumMailsPerBatch;
+    static int mailRowFetchSize;
+    static int mboxReadWindowSize;
     static int normalBatchSize;
     static int maximumBatchSize;
     static int minimumPauseTimeSeconds;
@@ -35,6 +37,21 @@ namespace GoogleEmailUploader {
         "https://apps-apis.google.com/a/feeds/migration/2.0/{0}/{1}/mail/batch";
     static bool traceEnabled;
     static bool logFullXml;
+    static bool useResumeMarks;
+    static bool sortContentTables;
+    static int mailReaderThreadCount;
+    static int mailReaderQueueLength;
+    static int mailPrefetchSize;
+    static bool streamMailBatches;
+    static int mailUploadThreadCount;
+    static int uploadMailsPerMinute;
+    static int uploadMailBurst;
+    static int uploadContactsPerMinute;
+    static int uploadContactBurst;
+    static int uploadBytesPerSecond;
+    static int uploadByteBurst;
+    static bool adaptMailBatchSize;
+    static int mailBatchLatencyTargetSeconds;
 
     static int TryGetConfigIntValue(string key,
                                     int defaultValue) {
@@ -69,6 +86,12 @@ namespace GoogleEmailUploader {
       GoogleEmailUploaderConfig.maximumMailsPerBatch =
           GoogleEmailUploaderConfig.TryGetConfigIntValue("MaximumMailsPerBatch",
                                                          15);
+      GoogleEmailUploaderConfig.mailRowFetchSize =
+          GoogleEmailUploaderConfig.TryGetConfigIntValue("MailRowFetchSize",
+                                                         256);
+      GoogleEmailUploaderConfig.mboxReadWindowSize =
+          GoogleEmailUploaderConfig.TryGetConfigIntValue("MboxReadWindowSize",
+                                                         64 * 1024);
       GoogleEmailUploaderConfig.normalBatchSize =
           GoogleEmailUploaderConfig.TryGetConfigIntValue("NormalBatchSize",
                                                          512 * 1024);
@@ -101,6 +124,62 @@ namespace GoogleEmailUploader {
       GoogleEmailUploaderConfig.logFullXml =
           GoogleEmailUploaderConfig.TryGetConfigBoolValue("LogFullXml",
                                                           false);
+      GoogleEmailUploaderConfig.useResumeMarks =
+          GoogleEmailUploaderConfig.TryGetConfigBoolValue("UseResumeMarks",
+                                                          false);
+      GoogleEmailUploaderConfig.sortContentTables =
+          GoogleEmailUploaderConfig.TryGetConfigBoolValue("SortContentTables",
+                                                          true);
+      GoogleEmailUploaderConfig.mailReaderThreadCount =
+          GoogleEmailUploaderConfig.TryGetConfigIntValue(
+              "MailReaderThreadCount",
+              1);
+      GoogleEmailUploaderConfig.mailReaderQueueLength =
+          GoogleEmailUploaderConfig.TryGetConfigIntValue(
+              "MailReaderQueueLength",
+              16);
+      GoogleEmailUploaderConfig.mailPrefetchSize =
+          GoogleEmailUploaderConfig.TryGetConfigIntValue(
+              "MailPrefetchSize",
+              0);
+      GoogleEmailUploaderConfig.streamMailBatches =
+          GoogleEmailUploaderConfig.TryGetConfigBoolValue("StreamMailBatches",
+                                                          false);
+      GoogleEmailUploaderConfig.mailUploadThreadCount =
+          GoogleEmailUploaderConfig.TryGetConfigIntValue(
+              "MailUploadThreadCount",
+              1);
+      GoogleEmailUploaderConfig.uploadMailsPerMinute =
+          GoogleEmailUploaderConfig.TryGetConfigIntValue(
+              "UploadMailsPerMinute",
+              54);
+      GoogleEmailUploaderConfig.uploadMailBurst =
+          GoogleEmailUploaderConfig.TryGetConfigIntValue(
+              "UploadMailBurst",
+              15);
+      GoogleEmailUploaderConfig.uploadContactsPerMinute =
+          GoogleEmailUploaderConfig.TryGetConfigIntValue(
+              "UploadContactsPerMinute",
+              0);
+      GoogleEmailUploaderConfig.uploadContactBurst =
+          GoogleEmailUploaderConfig.TryGetConfigIntValue(
+              "UploadContactBurst",
+              15);
+      GoogleEmailUploaderConfig.uploadBytesPerSecond =
+          GoogleEmailUploaderConfig.TryGetConfigIntValue(
+              "UploadBytesPerSecond",
+              0);
+      GoogleEmailUploaderConfig.uploadByteBurst =
+          GoogleEmailUploaderConfig.TryGetConfigIntValue(
+              "UploadByteBurst",
+              0);
+      GoogleEmailUploaderConfig.adaptMailBatchSize =
+          GoogleEmailUploaderConfig.TryGetConfigBoolValue("AdaptMailBatchSize",
+                                                          false);
+      GoogleEmailUploaderConfig.mailBatchLatencyTargetSeconds =
+          GoogleEmailUploaderConfig.TryGetConfigIntValue(
+              "MailBatchLatencyTargetSeconds",
+              30);
     }
 
     internal static int MaximumMailsPerBatch {
@@ -109,6 +188,29 @@ namespace GoogleEmailUploader {
       }
     }
 
+    // This is public because the mail client assemblies use it to decide how
+    // many rows they read from the store in one go.
+    public static int MailRowFetchSize {
+      get {
+        if (GoogleEmailUploaderConfig.mailRowFetchSize < 1) {
+          return 1;
+        }
+        return GoogleEmailUploaderConfig.mailRowFetchSize;
+      }
+    }
+
+    // Size of the window through which the mails of an mbox file are read
+    // when they are served straight from the file. This is public because
+    // the mail client assemblies use it.
+    public static int MboxReadWindowSize {
+      get {
+        if (GoogleEmailUploaderConfig.mboxReadWindowSize < 4096) {
+          return 4096;
+        }
+        return GoogleEmailUploaderConfig.mboxReadWindowSize;
+      }
+    }
+
     internal static int NormalBatchSize {
       get {
         return GoogleEmailUploaderConfig.normalBatchSize;
@@ -156,9 +258,170 @@ namespace GoogleEmailUploader {
         return GoogleEmailUploaderConfig.logFullXml;
       }
     }
+
+    // When true the folders are read from the resume mark saved by the
+    // earlier runs instead of from their start. Off by default, as a store
+    // might keep the times of a mail moved into a folder that was already
+    // uploaded, and such a mail would be skipped.
+    internal static bool UseResumeMarks {
+      get {
+        return GoogleEmailUploaderConfig.useResumeMarks;
+      }
+    }
+
+    // When false the mail clients read the folders in the natural order of
+    // the store instead of sorting them. Resume marks only make sense for
+    // sorted folders, so in that case the progress is kept by the uploaded
+    // mail ids alone. This is public because the mail client assemblies
+    // use it.
+    public static bool SortContentTables {
+      get {
+        return GoogleEmailUploaderConfig.sortContentTables;
+      }
+    }
+
+    // Number of threads reading and converting the mails. Reader threads
+    // are used only if all the selected folders are in stores that
+    // implement IConcurrentStore. Otherwise, or if this is 1 and
+    // MailPrefetchSize is 0, the mails are read by the uploading thread.
+    internal static int MailReaderThreadCount {
+      get {
+        if (GoogleEmailUploaderConfig.mailReaderThreadCount < 1) {
+          return 1;
+        }
+        return GoogleEmailUploaderConfig.mailReaderThreadCount;
+      }
+    }
+
+    // Number of mails the reader threads can get ahead of the upload.
+    internal static int MailReaderQueueLength {
+      get {
+        if (GoogleEmailUploaderConfig.mailReaderQueueLength < 1) {
+          return 1;
+        }
+        return GoogleEmailUploaderConfig.mailReaderQueueLength;
+      }
+    }
+
+    // Total size of the converted mails the reader threads can get ahead of
+    // the upload. A mail bigger than this is still read when nothing else is
+    // waiting. When this is positive a single reader thread converts the
+    // mails while the uploading thread sends the batch. 0 removes the limit
+    // and turns off the single reader thread. It is 0 by default, so the
+    // reader thread is only used when asked for, 8 MB being a good size.
+    internal static int MailPrefetchSize {
+      get {
+        if (GoogleEmailUploaderConfig.mailPrefetchSize < 0) {
+          return 0;
+        }
+        return GoogleEmailUploaderConfig.mailPrefetchSize;
+      }
+    }
+
+    // When true the mail batches are not built in memory. The batch keeps
+    // the rfc822 streams of its mails and writes the feed straight to the
+    // request, with chunked transfer encoding, every time it is sent.
+    internal static bool StreamMailBatches {
+      get {
+        return GoogleEmailUploaderConfig.streamMailBatches;
+      }
+    }
+
+    // Number of mail batches that are uploaded at the same time, each by its
+    // own thread with its own batch. More than 1 keeps the link busy when
+    // the round trip to the server is long. The results of the batches are
+    // still recorded in the order the batches were filled.
+    internal static int MailUploadThreadCount {
+      get {
+        if (GoogleEmailUploaderConfig.mailUploadThreadCount < 1) {
+          return 1;
+        }
+        return GoogleEmailUploaderConfig.mailUploadThreadCount;
+      }
+    }
+
+    // Number of mails sent to the server per minute. 0 or less removes the
+    // limit.
+    internal static int UploadMailsPerMinute {
+      get {
+        return GoogleEmailUploaderConfig.uploadMailsPerMinute;
+      }
+    }
+
+    // Number of mails that can be sent at once after the upload has been
+    // idle. A batch with more mails waits till this many are allowed.
+    internal static int UploadMailBurst {
+      get {
+        if (GoogleEmailUploaderConfig.uploadMailBurst < 1) {
+          return 1;
+        }
+        return GoogleEmailUploaderConfig.uploadMailBurst;
+      }
+    }
+
+    // Number of contacts sent to the server per minute. 0 or less removes
+    // the limit, which is the default.
+    internal static int UploadContactsPerMinute {
+      get {
+        return GoogleEmailUploaderConfig.uploadContactsPerMinute;
+      }
+    }
+
+    // Number of contacts that can be sent at once after the upload has been
+    // idle.
+    internal static int UploadContactBurst {
+      get {
+        if (GoogleEmailUploaderConfig.uploadContactBurst < 1) {
+          return 1;
+        }
+        return GoogleEmailUploaderConfig.uploadContactBurst;
+      }
+    }
+
+    // Number of bytes sent to the server per second. 0 or less removes the
+    // limit.
+    internal static int UploadBytesPerSecond {
+      get {
+        return GoogleEmailUploaderConfig.uploadBytesPerSecond;
+      }
+    }
+
+    // Number of bytes that can be sent at once after the upload has been
+    // idle. Defaults to MaximumBatchSize.
+    internal static int UploadByteBurst {
+      get {
+        if (GoogleEmailUploaderConfig.uploadByteBurst < 1) {
+          return GoogleEmailUploaderConfig.MaximumBatchSize;
+        }
+        return GoogleEmailUploaderConfig.uploadByteBurst;
+      }
+    }
+
+    // When true the size of the mail batches follows how the server and the
+    // link are doing, between the bounds set by NormalBatchSize,
+    // MaximumBatchSize and MaximumMailsPerBatch.
+    internal static bool AdaptMailBatchSize {
+      get {
+        return GoogleEmailUploaderConfig.adaptMailBatchSize;
+      }
+    }
+
+    // Seconds a mail batch can take to go through before the adaptive
+    // sizing makes the batches smaller.
+    internal static int MailBatchLatencyTarget {
+      get {
+        if (GoogleEmailUploaderConfig.mailBatchLatencyTargetSeconds < 1) {
+          return 1;
+        }
+        return GoogleEmailUploaderConfig.mailBatchLatencyTargetSeconds;
+      }
+    }
   }
 
   public class GoogleEmailUploaderTrace {
+    // The upload and the mail reader threads trace at the same time, so the
+    // writer and the indent are used under this lock.
+    static readonly object TraceLock = new object();
     static StreamWriter traceStreamWriter;
     static string indentString;
 
@@ -168,75 +431,90 @@ namespace GoogleEmailUploader {
 
     [Conditional("TRACE")]
     public static void Initalize(string traceFilePath) {
-      if (GoogleEmailUploaderConfig.TraceEnabled) {
-        GoogleEmailUploaderTrace.traceStreamWriter =
-            File.AppendText(traceFilePath);
-        GoogleEmailUploaderTrace.traceStreamWriter.WriteLine(
-            "{0} Starting run",
-            GoogleEmailUploaderTrace.GetDateTime());
-        GoogleEmailUploaderTrace.indentString = "  ";
+      lock (GoogleEmailUploaderTrace.TraceLock) {
+        if (GoogleEmailUploaderConfig.TraceEnabled) {
+          GoogleEmailUploaderTrace.traceStreamWriter =
+              File.AppendText(traceFilePath);
+          GoogleEmailUploaderTrace.traceStreamWriter.WriteLine(
+              "{0} Starting run",
+              GoogleEmailUploaderTrace.GetDateTime());
+          GoogleEmailUploaderTrace.indentString = "  ";
+        }
       }
     }
 
     [Conditional("TRACE")]
     internal static void EnteringMethod(string methodName) {
-      if (GoogleEmailUploaderConfig.TraceEnabled) {
-        GoogleEmailUploaderTrace.traceStreamWriter.Write(
-            GoogleEmailUploaderTrace.GetDateTime());
-        GoogleEmailUploaderTrace.traceStreamWriter.Write(
-            GoogleEmailUploaderTrace.indentString);
-        GoogleEmailUploaderTrace.traceStreamWriter.WriteLine(
-            "EnteringMethod: {0}",
-            methodName);
-        GoogleEmailUploaderTrace.traceStreamWriter.Flush();
-        GoogleEmailUploaderTrace.indentString =
-            GoogleEmailUploaderTrace.indentString + "  ";
+      lock (GoogleEmailUploaderTrace.TraceLock) {
+        if (GoogleEmailUploaderConfig.TraceEnabled) {
+          GoogleEmailUploaderTrace.traceStreamWriter.Write(
+              GoogleEmailUploaderTrace.GetDateTime());
+          GoogleEmailUploaderTrace.traceStreamWriter.Write(
+              GoogleEmailUploaderTrace.indentString);
+          GoogleEmailUploaderTrace.traceStreamWriter.WriteLine(
+              "EnteringMethod: {0}",
+              methodName);
+          GoogleEmailUploaderTrace.traceStreamWriter.Flush();
+          GoogleEmailUploaderTrace.indentString =
+              GoogleEmailUploaderTrace.indentString + "  ";
+        }
       }
     }
 
     [Conditional("TRACE")]
     internal static void ExitingMethod(string methodName) {
-      if (GoogleEmailUploaderConfig.TraceEnabled) {
-        GoogleEmailUploaderTrace.traceStreamWriter.Write(
-            GoogleEmailUploaderTrace.GetDateTime());
-        GoogleEmailUploaderTrace.indentString =
-            GoogleEmailUploaderTrace.indentString.Substring(2);
-        GoogleEmailUploaderTrace.traceStreamWriter.Write(
-            GoogleEmailUploaderTrace.indentString);
-        GoogleEmailUploaderTrace.traceStreamWriter.WriteLine(
-            "ExitingMethod: {0}",
-            methodName);
-        GoogleEmailUploaderTrace.traceStreamWriter.Flush();
+      lock (GoogleEmailUploaderTrace.TraceLock) {
+        if (GoogleEmailUploaderConfig.TraceEnabled) {
+          GoogleEmailUploaderTrace.traceStreamWriter.Write(
+              GoogleEmailUploaderTrace.GetDateTime());
+          if (GoogleEmailUploaderTrace.indentString.Length >= 2) {
+            GoogleEmailUploaderTrace.indentString =
+                GoogleEmailUploaderTrace.indentString.Substring(2);
+          }
+          GoogleEmailUploaderTrace.traceStreamWriter.Write(
+              GoogleEmailUploaderTrace.indentString);
+          GoogleEmailUploaderTrace.traceStreamWriter.WriteLine(
+              "ExitingMethod: {0}",
+              methodName);
+          GoogleEmailUploaderTrace.traceStreamWriter.Flush();
+        }
       }
     }
 
     [Conditional("TRACE")]
     internal static void WriteXml(string xml) {
-      if (GoogleEmailUploaderConfig.TraceEnabled) {
-        GoogleEmailUploaderTrace.traceStreamWriter.WriteLine(xml);
-        GoogleEmailUploaderTrace.traceStreamWriter.Flush();
+      lock (GoogleEmailUploaderTrace.TraceLock) {
+        if (GoogleEmailUploaderConfig.TraceEnabled) {
+          GoogleEmailUploaderTrace.traceStreamWriter.WriteLine(xml);
+          GoogleEmailUploaderTrace.traceStreamWriter.Flush();
+        }
       }
     }
 
+    // This is public so that the mail client assemblies can trace too.
     [Conditional("TRACE")]
-    internal static void WriteLine(string message, params object[] args) {
-      if (GoogleEmailUploaderConfig.TraceEnabled) {
-        GoogleEmailUploaderTrace.traceStreamWriter.Write(
-            GoogleEmailUploaderTrace.GetDateTime());
-        GoogleEmailUploaderTrace.traceStreamWriter.Write(
-            GoogleEmailUploaderTrace.indentString);
-        GoogleEmailUploaderTrace.traceStreamWriter.WriteLine(message, args);
-        GoogleEmailUploaderTrace.traceStreamWriter.Flush();
+    public static void WriteLine(string message, params object[] args) {
+      lock (GoogleEmailUploaderTrace.TraceLock) {
+        if (GoogleEmailUploaderConfig.TraceEnabled) {
+          GoogleEmailUploaderTrace.traceStreamWriter.Write(
+              GoogleEmailUploaderTrace.GetDateTime());
+          GoogleEmailUploaderTrace.traceStreamWriter.Write(
+              GoogleEmailUploaderTrace.indentString);
+          GoogleEmailUploaderTrace.traceStreamWriter.WriteLine(message, args);
+          GoogleEmailUploaderTrace.traceStreamWriter.Flush();
+        }
       }
     }
 
     [Conditional("TRACE")]
     public static void Close() {
-      if (GoogleEmailUploaderConfig.TraceEnabled) {
-        GoogleEmailUploaderTrace.traceStreamWriter.WriteLine(
-            "{0} Ending run",
-            GoogleEmailUploaderTrace.GetDateTime());
-        GoogleEmailUploaderTrace.traceStreamWriter.Close();
+      lock (GoogleEmailUploaderTrace.TraceLock) {
+        if (GoogleEmailUploaderConfig.TraceEnabled) {
+          GoogleEmailUploaderTrace.traceStreamWriter.WriteLine(
+              "{0} Ending run",
+              GoogleEmailUploaderTrace.GetDateTime());
+          GoogleEmailUploaderTrace.traceStreamWriter.Close();
+        }
       }
     }
   }
@@ -455,6 +733,223 @@ namespace GoogleEmailUploader {
     }
   }
 
+  /// <summary>
+  /// Set of mail ids kept as 128 bit MurmurHash3 keys in an open addressing
+  /// table. This takes 16 bytes per mail id instead of a hex string and a
+  /// hashtable bucket, which adds up when millions of mails have been
+  /// uploaded. Since the key is computed from the mail id string, ids
+  /// persisted by older versions map to the same keys as the ids enumerated
+  /// now. The hash is not a cryptographic one, as MD5 is not available
+  /// where the FIPS policy is enforced.
+  /// </summary>
+  public sealed class MailIdSet {
+    // Must be a power of 2.
+    const int InitialCapacity = 64;
+    const int KeySize = 16;
+    const ulong MurmurC1 = 0x87c37b91114253d5;
+    const ulong MurmurC2 = 0x4cf5ad432745937f;
+
+    // Each slot takes two consecutive entries. A slot with both the halves
+    // zero is empty.
+    ulong[] slots;
+    int count;
+
+    internal MailIdSet() {
+      this.slots = new ulong[2 * MailIdSet.InitialCapacity];
+    }
+
+    public int Count {
+      get {
+        return this.count;
+      }
+    }
+
+    static ulong RotateLeft(ulong x,
+                            int bits) {
+      return (x << bits) | (x >> (64 - bits));
+    }
+
+    static ulong FinalMix(ulong k) {
+      k ^= k >> 33;
+      k *= 0xff51afd7ed558ccd;
+      k ^= k >> 33;
+      k *= 0xc4ceb9fe1a85ec53;
+      k ^= k >> 33;
+      return k;
+    }
+
+    // MurmurHash3 x64 128 with a seed of 0.
+    static void ComputeKey(string mailId,
+                           out ulong high,
+                           out ulong low) {
+      byte[] data = Encoding.UTF8.GetBytes(mailId);
+      ulong h1 = 0;
+      ulong h2 = 0;
+      int blockEnd = data.Length - data.Length % 16;
+      for (int i = 0; i < blockEnd; i += 16) {
+        ulong k1 = BitConverter.ToUInt64(data, i);
+        ulong k2 = BitConverter.ToUInt64(data, i + 8);
+        k1 *= MailIdSet.MurmurC1;
+        k1 = MailIdSet.RotateLeft(k1, 31);
+        k1 *= MailIdSet.MurmurC2;
+        h1 ^= k1;
+        h1 = MailIdSet.RotateLeft(h1, 27);
+        h1 += h2;
+        h1 = h1 * 5 + 0x52dce729;
+        k2 *= MailIdSet.MurmurC2;
+        k2 = MailIdSet.RotateLeft(k2, 33);
+        k2 *= MailIdSet.MurmurC1;
+        h2 ^= k2;
+        h2 = MailIdSet.RotateLeft(h2, 31);
+        h2 += h1;
+        h2 = h2 * 5 + 0x38495ab5;
+      }
+      // The tail, little endian, the first 8 bytes in k1.
+      ulong tail1 = 0;
+      ulong tail2 = 0;
+      for (int i = data.Length - 1; i >= blockEnd; --i) {
+        int offset = i - blockEnd;
+        if (offset >= 8) {
+          tail2 |= (ulong)data[i] << (8 * (offset - 8));
+        } else {
+          tail1 |= (ulong)data[i] << (8 * offset);
+        }
+      }
+      if (data.Length - blockEnd > 8) {
+        tail2 *= MailIdSet.MurmurC2;
+        tail2 = MailIdSet.RotateLeft(tail2, 33);
+        tail2 *= MailIdSet.MurmurC1;
+        h2 ^= tail2;
+      }
+      if (data.Length - blockEnd > 0) {
+        tail1 *= MailIdSet.MurmurC1;
+        tail1 = MailIdSet.RotateLeft(tail1, 31);
+        tail1 *= MailIdSet.MurmurC2;
+        h1 ^= tail1;
+      }
+      h1 ^= (ulong)data.Length;
+      h2 ^= (ulong)data.Length;
+      h1 += h2;
+      h2 += h1;
+      h1 = MailIdSet.FinalMix(h1);
+      h2 = MailIdSet.FinalMix(h2);
+      h1 += h2;
+      h2 += h1;
+      high = h1;
+      low = h2;
+      if (high == 0 && low == 0) {
+        // Zero marks an empty slot, so we move the one key that maps to it.
+        low = 1;
+      }
+    }
+
+    // Returns the slot holding the key, or the empty slot where it should
+    // go.
+    int FindSlot(ulong high,
+                 ulong low) {
+      int mask = this.slots.Length / 2 - 1;
+      // The key is uniform so its low bits are as good as any hash.
+      int slot = (int)(low & (ulong)mask);
+      while (true) {
+        ulong slotHigh = this.slots[2 * slot];
+        ulong slotLow = this.slots[2 * slot + 1];
+        if ((slotHigh == high && slotLow == low) ||
+            (slotHigh == 0 && slotLow == 0)) {
+          return slot;
+        }
+        slot = (slot + 1) & mask;
+      }
+    }
+
+    void Grow() {
+      ulong[] oldSlots = this.slots;
+      this.slots = new ulong[2 * oldSlots.Length];
+      for (int i = 0; i < oldSlots.Length; i += 2) {
+        if (oldSlots[i] == 0 && oldSlots[i + 1] == 0) {
+          continue;
+        }
+        int slot = this.FindSlot(oldSlots[i], oldSlots[i + 1]);
+        this.slots[2 * slot] = oldSlots[i];
+        this.slots[2 * slot + 1] = oldSlots[i + 1];
+      }
+    }
+
+    bool AddKey(ulong high,
+                ulong low) {
+      // We keep the table at most half full so that the probes stay short.
+      if (2 * (this.count + 1) > this.slots.Length / 2) {
+        this.Grow();
+      }
+      int slot = this.FindSlot(high, low);
+      if (this.slots[2 * slot] == high && this.slots[2 * slot + 1] == low) {
+        return false;
+      }
+      this.slots[2 * slot] = high;
+      this.slots[2 * slot + 1] = low;
+      this.count++;
+      return true;
+    }
+
+    public bool Contains(string mailId) {
+      ulong high;
+      ulong low;
+      MailIdSet.ComputeKey(mailId, out high, out low);
+      int slot = this.FindSlot(high, low);
+      return this.slots[2 * slot] == high && this.slots[2 * slot + 1] == low;
+    }
+
+    /// <summary>
+    /// Adds the mail id and returns false if it was already present.
+    /// </summary>
+    public bool Add(string mailId) {
+      ulong high;
+      ulong low;
+      MailIdSet.ComputeKey(mailId, out high, out low);
+      return this.AddKey(high, low);
+    }
+
+    /// <summary>
+    /// Adds the keys from the array returned by ToByteArray and returns the
+    /// number of keys that were not already present.
+    /// </summary>
+    internal int AddKeys(byte[] keys) {
+      int addedCount = 0;
+      for (int i = 0; i + MailIdSet.KeySize <= keys.Length;
+           i += MailIdSet.KeySize) {
+        ulong high = BitConverter.ToUInt64(keys, i);
+        ulong low = BitConverter.ToUInt64(keys, i + 8);
+        if (high == 0 && low == 0) {
+          continue;
+        }
+        if (this.AddKey(high, low)) {
+          addedCount++;
+        }
+      }
+      return addedCount;
+    }
+
+    /// <summary>
+    /// Returns all the keys packed one after the other, 16 bytes each.
+    /// </summary>
+    internal byte[] ToByteArray() {
+      byte[] keys = new byte[this.count * MailIdSet.KeySize];
+      int offset = 0;
+      for (int i = 0; i < this.slots.Length; i += 2) {
+        if (this.slots[i] == 0 && this.slots[i + 1] == 0) {
+          continue;
+        }
+        Array.Copy(BitConverter.GetBytes(this.slots[i]), 0,
+                   keys, offset,
+                   8);
+        Array.Copy(BitConverter.GetBytes(this.slots[i + 1]), 0,
+                   keys, offset + 8,
+                   8);
+        offset += MailIdSet.KeySize;
+      }
+      return keys;
+    }
+  }
+
   public sealed class FolderModel : TreeNodeModel {
     public readonly IFolder Folder;
     readonly ArrayList subFolderModels;
@@ -465,12 +960,16 @@ namespace GoogleEmailUploader {
     string[] labels;
     uint uploadedMailCount;
     uint failedMailCount;
-    // mailData hashtable is used for knowing what is happening with each
-    // mail. If the mail id is not present in this then the mail is not
-    // uploaded if is present and value is:
-    //    null -> Successfully uploaded
-    //    non null -> value should be of type FailedMailDatum
-    Hashtable mailUploadData;
+    // The mails that were successfully uploaded. This is where most of the
+    // mail ids end up, so it is kept compact.
+    MailIdSet uploadedMailIds;
+    // The mails that failed to upload, from mail id to FailedMailDatum. A mail
+    // present in neither of these is not uploaded yet.
+    Hashtable failedMailData;
+    // Resume mark of the last mail whose upload was recorded. All the mails
+    // before it in the folder have been processed, so the next run starts
+    // enumerating from here.
+    string resumeMark;
 
     internal FolderModel(TreeNodeModel parent,
                          IFolder folder,
@@ -485,7 +984,8 @@ namespace GoogleEmailUploader {
                 folderIter,
                 googleEmailUploaderModel));
       }
-      this.mailUploadData = new Hashtable();
+      this.uploadedMailIds = new MailIdSet();
+      this.failedMailData = new Hashtable();
     }
     
     public override string DisplayName {
@@ -623,40 +1123,469 @@ namespace GoogleEmailUploader {
       }
     }
 
-    public Hashtable MailUploadData {
+    public MailIdSet UploadedMailIds {
+      get {
+        return this.uploadedMailIds;
+      }
+    }
+
+    public Hashtable FailedMailData {
+      get {
+        return this.failedMailData;
+      }
+    }
+
+    public string ResumeMark {
       get {
-        return this.mailUploadData;
+        return this.resumeMark;
+      }
+    }
+
+    /// <summary>
+    /// Moves the resume mark forward to the given mark. Marks that are behind
+    /// the current one are ignored.
+    /// </summary>
+    internal void AdvanceResumeMark(string resumeMark) {
+      if (resumeMark == null || resumeMark.Length == 0) {
+        return;
+      }
+      lock (this) {
+        if (this.resumeMark == null ||
+            string.CompareOrdinal(resumeMark, this.resumeMark) > 0) {
+          this.resumeMark = resumeMark;
+        }
+      }
+    }
+
+    /// <summary>
+    /// Called with the resume mark of the first mail enumerated from the
+    /// given mark. If that mail is behind the mark, the folder no longer
+    /// matches the mark (say Thunderbird compacted it) and was enumerated
+    /// from the start. The mark is then dropped so that the marks of this
+    /// run replace it instead of being ignored as smaller.
+    /// </summary>
+    internal void CheckResumeMark(string resumeMark,
+                                  string firstMailResumeMark) {
+      if (resumeMark == null ||
+          firstMailResumeMark == null ||
+          firstMailResumeMark.Length == 0 ||
+          string.CompareOrdinal(firstMailResumeMark, resumeMark) >= 0) {
+        return;
+      }
+      lock (this) {
+        if (this.resumeMark == resumeMark) {
+          this.resumeMark = null;
+        }
       }
     }
 
+    // The mail reader threads check the mails against the folder while the
+    // uploading thread records them, so the mail data is accessed under the
+    // lock of the folder model.
     public bool IsUploaded(string emailId) {
       if (emailId == null || emailId.Length == 0) {
         return false;
       }
-      return this.mailUploadData.ContainsKey(emailId);
+      lock (this) {
+        return this.failedMailData.ContainsKey(emailId) ||
+            this.uploadedMailIds.Contains(emailId);
+      }
     }
 
     public void SuccessfullyUploaded(string emailId) {
-      this.uploadedMailCount++;
-      if (emailId == null || emailId.Length == 0) {
-        return;
+      lock (this) {
+        this.uploadedMailCount++;
+        if (emailId == null || emailId.Length == 0) {
+          return;
+        }
+        if (this.failedMailData.ContainsKey(emailId)) {
+          return;
+        }
+        this.uploadedMailIds.Add(emailId);
       }
-      if (this.mailUploadData.ContainsKey(emailId)) {
-        return;
+    }
+
+    /// <summary>
+    /// Restores the uploaded mails persisted as packed keys.
+    /// </summary>
+    internal void SuccessfullyUploaded(byte[] mailKeys) {
+      lock (this) {
+        this.uploadedMailCount +=
+            (uint)this.uploadedMailIds.AddKeys(mailKeys);
       }
-      this.mailUploadData.Add(emailId, null);
     }
 
     public void FailedToUpload(string emailId,
                                FailedMailDatum failedMailDatum) {
-      this.failedMailCount++;
-      if (emailId == null || emailId.Length == 0) {
-        return;
+      lock (this) {
+        this.failedMailCount++;
+        if (emailId == null || emailId.Length == 0) {
+          return;
+        }
+        if (this.failedMailData.ContainsKey(emailId) ||
+            this.uploadedMailIds.Contains(emailId)) {
+          return;
+        }
+        this.failedMailData.Add(emailId, failedMailDatum);
       }
-      if (this.mailUploadData.ContainsKey(emailId)) {
-        return;
+    }
+  }
+
+  /// <summary>
+  /// A mail read by ConcurrentMailReader along with its rfc822 stream. The
+  /// stream is null if the mail was found to be too large to upload before
+  /// converting it.
+  /// </summary>
+  class ReadMailDatum {
+    internal readonly IMail Mail;
+    internal readonly Stream MailStream;
+    internal readonly FolderModel FolderModel;
+
+    internal ReadMailDatum(IMail mail,
+                           Stream mailStream,
+                           FolderModel folderModel) {
+      this.Mail = mail;
+      this.MailStream = mailStream;
+      this.FolderModel = folderModel;
+    }
+
+    internal long Size {
+      get {
+        if (this.MailStream == null) {
+          return 0;
+        }
+        return this.MailStream.Length;
+      }
+    }
+
+    internal void Dispose() {
+      if (this.MailStream != null) {
+        this.MailStream.Close();
+      }
+      this.Mail.Dispose();
+    }
+  }
+
+  /// <summary>
+  /// Reads and converts the mails of the folders on several threads and hands
+  /// them to the uploading thread through a bounded queue. Each thread reads
+  /// whole folders through its own session on the store. The mails are
+  /// handed over in the order of the folders, as if they were read on one
+  /// thread, while the threads reading the later folders work ahead.
+  /// </summary>
+  class ConcurrentMailReader : IDisposable {
+    /// <summary>
+    /// The mails of a folder that are read but not yet taken.
+    /// </summary>
+    class FolderQueue {
+      internal readonly Queue ReadMails = new Queue();
+      internal long Size;
+      // Set when the reader is done with the folder.
+      internal bool IsRead;
+    }
+
+    readonly ArrayList folderModelList;
+    readonly int maximumQueueLength;
+    // 0 if the size of the queue is not limited.
+    readonly long maximumQueueSize;
+    // The queue of each folder in folderModelList. Set to null once the
+    // folder has been taken.
+    readonly FolderQueue[] folderQueues;
+    readonly Thread[] readerThreads;
+    // Count and size of the mails in all the folder queues.
+    int queueLength;
+    long queueSize;
+    int folderIterationIndex;
+    // Index of the folder whose mails the uploading thread takes.
+    int takeFolderIndex;
+    int runningReaderCount;
+    bool isDisposed;
+    // Set when a folder could not be read to the end.
+    bool hasReadFailures;
+
+    /// <summary>
+    /// All the folders in folderModelList should be in stores that
+    /// implement IConcurrentStore.
+    /// </summary>
+    internal ConcurrentMailReader(ArrayList folderModelList,
+                                  int readerCount,
+                                  int maximumQueueLength,
+                                  long maximumQueueSize) {
+      this.folderModelList = folderModelList;
+      this.maximumQueueLength = maximumQueueLength;
+      this.maximumQueueSize = maximumQueueSize;
+      this.folderQueues = new FolderQueue[folderModelList.Count];
+      for (int i = 0; i < this.folderQueues.Length; ++i) {
+        this.folderQueues[i] = new FolderQueue();
+      }
+      this.readerThreads = new Thread[readerCount];
+      this.runningReaderCount = readerCount;
+      for (int i = 0; i < readerCount; ++i) {
+        Thread readerThread = new Thread(new ThreadStart(this.ReaderMethod));
+        readerThread.Name = "MailReader" + i;
+        readerThread.IsBackground = true;
+        // The sessions are opened and used in the reader thread, and the mail
+        // clients expect them to be in the multithreaded apartment.
+        readerThread.ApartmentState = ApartmentState.MTA;
+        this.readerThreads[i] = readerThread;
+      }
+      for (int i = 0; i < readerCount; ++i) {
+        this.readerThreads[i].Start();
+      }
+    }
+
+    /// <summary>
+    /// Returns true if all the folders are in stores that implement
+    /// IConcurrentStore.
+    /// </summary>
+    internal static bool IsConcurrentlyReadable(ArrayList folderModelList) {
+      foreach (FolderModel folderModel in folderModelList) {
+        if (!(folderModel.Folder.Store is IConcurrentStore)) {
+          return false;
+        }
+      }
+      return true;
+    }
+
+    // Returns the index of the next folder to read, or -1 if there are no
+    // more folders.
+    int TakeNextFolder() {
+      lock (this) {
+        if (this.isDisposed ||
+            this.folderIterationIndex >= this.folderModelList.Count) {
+          return -1;
+        }
+        int folderIndex = this.folderIterationIndex;
+        this.folderIterationIndex++;
+        return folderIndex;
+      }
+    }
+
+    static bool IsFull(int length,
+                       long size,
+                       int maximumLength,
+                       long maximumSize,
+                       long nextMailSize) {
+      if (length >= maximumLength) {
+        return true;
+      }
+      // An empty queue always takes the mail, however big it is.
+      return maximumSize != 0 &&
+             length != 0 &&
+             size + nextMailSize > maximumSize;
+    }
+
+    bool IsQueueFull(int folderIndex,
+                     long nextMailSize) {
+      if (folderIndex == this.takeFolderIndex) {
+        // The uploading thread is waiting for the mails of this folder, so
+        // they are limited on their own. Otherwise the mails of the later
+        // folders could fill the queue and keep them out for good.
+        FolderQueue folderQueue = this.folderQueues[folderIndex];
+        return ConcurrentMailReader.IsFull(folderQueue.ReadMails.Count,
+                                           folderQueue.Size,
+                                           this.maximumQueueLength,
+                                           this.maximumQueueSize,
+                                           nextMailSize);
+      }
+      return ConcurrentMailReader.IsFull(this.queueLength,
+                                         this.queueSize,
+                                         this.maximumQueueLength,
+                                         this.maximumQueueSize,
+                                         nextMailSize);
+    }
+
+    // Blocks while the queue is full. Returns false if the reader was
+    // disposed in the meantime.
+    bool PutReadMail(int folderIndex,
+                     ReadMailDatum readMailDatum) {
+      long size = readMailDatum.Size;
+      lock (this) {
+        while (!this.isDisposed &&
+               this.IsQueueFull(folderIndex, size)) {
+          Monitor.Wait(this);
+        }
+        if (this.isDisposed) {
+          return false;
+        }
+        FolderQueue folderQueue = this.folderQueues[folderIndex];
+        folderQueue.ReadMails.Enqueue(readMailDatum);
+        folderQueue.Size += size;
+        this.queueLength++;
+        this.queueSize += size;
+        Monitor.PulseAll(this);
+        return true;
+      }
+    }
+
+    void FinishFolder(int folderIndex) {
+      lock (this) {
+        this.folderQueues[folderIndex].IsRead = true;
+        Monitor.PulseAll(this);
+      }
+    }
+
+    /// <summary>
+    /// Blocks till the next mail is read. Returns null when all the folders
+    /// have been read.
+    /// </summary>
+    internal ReadMailDatum TakeReadMail() {
+      lock (this) {
+        while (this.takeFolderIndex < this.folderQueues.Length) {
+          FolderQueue folderQueue = this.folderQueues[this.takeFolderIndex];
+          if (folderQueue.ReadMails.Count != 0) {
+            ReadMailDatum readMailDatum =
+                (ReadMailDatum)folderQueue.ReadMails.Dequeue();
+            long size = readMailDatum.Size;
+            folderQueue.Size -= size;
+            this.queueLength--;
+            this.queueSize -= size;
+            Monitor.PulseAll(this);
+            return readMailDatum;
+          }
+          if (folderQueue.IsRead) {
+            // Move on to the next folder. Its reader may be waiting for the
+            // queue to make room.
+            this.folderQueues[this.takeFolderIndex] = null;
+            this.takeFolderIndex++;
+            Monitor.PulseAll(this);
+            continue;
+          }
+          if (this.runningReaderCount == 0) {
+            // The readers failed before getting to this folder.
+            break;
+          }
+          Monitor.Wait(this);
+        }
+        return null;
+      }
+    }
+
+    void ReadFolder(IMailSession mailSession,
+                    int folderIndex) {
+      FolderModel folderModel =
+          (FolderModel)this.folderModelList[folderIndex];
+      string resumeMark = null;
+      if (GoogleEmailUploaderConfig.UseResumeMarks &&
+          GoogleEmailUploaderConfig.SortContentTables) {
+        resumeMark = folderModel.ResumeMark;
+      }
+      IEnumerator mailEnumerator =
+          mailSession.GetMails(folderModel.Folder,
+                               resumeMark).GetEnumerator();
+      try {
+        bool isFirstMail = true;
+        while (mailEnumerator.MoveNext()) {
+          IMail mail = (IMail)mailEnumerator.Current;
+          if (isFirstMail) {
+            isFirstMail = false;
+            folderModel.CheckResumeMark(resumeMark,
+                                        MailIterator.GetResumeMark(mail));
+          }
+          if (folderModel.IsUploaded(mail.MailId)) {
+            mail.Dispose();
+            continue;
+          }
+          // The uploading thread fails the mails that are too large, so we
+          // don't convert them.
+          Stream mailStream = null;
+          if (!MailIterator.IsKnownToBeTooLarge(mail)) {
+            mailStream = mail.OpenRfc822Stream();
+          }
+          ReadMailDatum readMailDatum =
+              new ReadMailDatum(mail,
+                                mailStream,
+                                folderModel);
+          if (!this.PutReadMail(folderIndex, readMailDatum)) {
+            readMailDatum.Dispose();
+            return;
+          }
+        }
+      } finally {
+        IDisposable disposable = mailEnumerator as IDisposable;
+        if (disposable != null) {
+          disposable.Dispose();
+        }
+        // If reading failed midway the rest of the folder is left for the
+        // next run, and the uploading thread moves on.
+        this.FinishFolder(folderIndex);
+      }
+    }
+
+    /// <summary>
+    /// True if some folder could not be read to the end. The mails that
+    /// were not read are left for the next run.
+    /// </summary>
+    internal bool HasReadFailures {
+      get {
+        lock (this) {
+          return this.hasReadFailures;
+        }
+      }
+    }
+
+    void ReaderMethod() {
+      // The sessions opened by this thread keyed by the store.
+      Hashtable mailSessions = new Hashtable();
+      int folderIndex;
+      try {
+        while ((folderIndex = this.TakeNextFolder()) != -1) {
+          try {
+            FolderModel folderModel =
+                (FolderModel)this.folderModelList[folderIndex];
+            IConcurrentStore concurrentStore =
+                (IConcurrentStore)folderModel.Folder.Store;
+            IMailSession mailSession =
+                (IMailSession)mailSessions[concurrentStore];
+            if (mailSession == null) {
+              mailSession = concurrentStore.OpenMailSession();
+              mailSessions.Add(concurrentStore,
+                               mailSession);
+            }
+            this.ReadFolder(mailSession,
+                            folderIndex);
+          } catch (Exception exception) {
+            // The mails that could not be read are left for the next run,
+            // and we go on with the next folder.
+            GoogleEmailUploaderTrace.WriteLine(
+                "Mail reader failed: {0}",
+                exception.ToString());
+            lock (this) {
+              this.hasReadFailures = true;
+            }
+            // The uploading thread must not wait for this folder.
+            this.FinishFolder(folderIndex);
+          }
+        }
+      } finally {
+        foreach (IMailSession mailSession in mailSessions.Values) {
+          mailSession.Dispose();
+        }
+        lock (this) {
+          this.runningReaderCount--;
+          Monitor.PulseAll(this);
+        }
+      }
+    }
+
+    /// <summary>
+    /// Stops the reader threads and disposes the mails that were not taken.
+    /// </summary>
+    public void Dispose() {
+      lock (this) {
+        this.isDisposed = true;
+        Monitor.PulseAll(this);
+      }
+      // The readers finish the mail they are converting and exit.
+      for (int i = 0; i < this.readerThreads.Length; ++i) {
+        this.readerThreads[i].Join();
+      }
+      for (int i = this.takeFolderIndex; i < this.folderQueues.Length; ++i) {
+        Queue readMails = this.folderQueues[i].ReadMails;
+        while (readMails.Count != 0) {
+          ((ReadMailDatum)readMails.Dequeue()).Dispose();
+        }
       }
-      this.mailUploadData.Add(emailId, failedMailDatum);
     }
   }
 
@@ -671,11 +1600,31 @@ namespace GoogleEmailUploader {
     FolderModel currentFolderModel;
     IEnumerator currentFolderEnumerator;
     IMail currentMail;
+    Stream currentMailStream;
+    // This is null when the mails are read in the uploading thread.
+    ConcurrentMailReader concurrentMailReader;
 
     internal MailIterator(ArrayList folderModelFlatList,
                           VoidDelegate failedMailIncrementDelegate) {
       this.folderModelFlatList = folderModelFlatList;
       this.failedMailIncrementDelegate = failedMailIncrementDelegate;
+      if (GoogleEmailUploaderConfig.MailReaderThreadCount > 1 ||
+          GoogleEmailUploaderConfig.MailPrefetchSize > 0) {
+        ArrayList folderModelList = new ArrayList();
+        foreach (FolderModel folderModel in folderModelFlatList) {
+          if (folderModel.IsSelected && folderModel.Folder.MailCount != 0) {
+            folderModelList.Add(folderModel);
+          }
+        }
+        if (ConcurrentMailReader.IsConcurrentlyReadable(folderModelList)) {
+          this.concurrentMailReader =
+              new ConcurrentMailReader(
+                  folderModelList,
+                  GoogleEmailUploaderConfig.MailReaderThreadCount,
+                  GoogleEmailUploaderConfig.MailReaderQueueLength,
+                  GoogleEmailUploaderConfig.MailPrefetchSize);
+        }
+      }
     }
 
     void DisposeCurrentEnumerator() {
@@ -687,6 +1636,10 @@ namespace GoogleEmailUploader {
     }
 
     void DisposeCurrentMail() {
+      if (this.currentMailStream != null) {
+        this.currentMailStream.Close();
+        this.currentMailStream = null;
+      }
       IDisposable disposable = this.currentMail as IDisposable;
       if (disposable != null) {
         disposable.Dispose();
@@ -697,6 +1650,10 @@ namespace GoogleEmailUploader {
     public void Dispose() {
       this.DisposeCurrentMail();
       this.DisposeCurrentEnumerator();
+      if (this.concurrentMailReader != null) {
+        this.concurrentMailReader.Dispose();
+        this.concurrentMailReader = null;
+      }
     }
 
     bool MoveToNextNonEmptySelectedFolder() {
@@ -709,14 +1666,30 @@ namespace GoogleEmailUploader {
             this.currentFolderModel.Folder.MailCount == 0) {
           continue;
         }
-        this.currentFolderEnumerator =
-            this.currentFolderModel.Folder.Mails.GetEnumerator();
+        IEnumerable mails = this.currentFolderModel.Folder.Mails;
+        IResumableFolder resumableFolder =
+            this.currentFolderModel.Folder as IResumableFolder;
+        string resumeMark = null;
+        if (GoogleEmailUploaderConfig.UseResumeMarks &&
+            GoogleEmailUploaderConfig.SortContentTables &&
+            resumableFolder != null &&
+            this.currentFolderModel.ResumeMark != null) {
+          // Skip straight to the mails that were not processed in the
+          // earlier runs.
+          resumeMark = this.currentFolderModel.ResumeMark;
+          mails = resumableFolder.GetMailsFrom(resumeMark);
+        }
+        this.currentFolderEnumerator = mails.GetEnumerator();
         if (!this.currentFolderEnumerator.MoveNext()) {
           // We reached the end of the folder
           // so dispose enumerator and continue with the next folder.
           this.DisposeCurrentEnumerator();
           continue;
         }
+        this.currentFolderModel.CheckResumeMark(
+            resumeMark,
+            MailIterator.GetResumeMark(
+                (IMail)this.currentFolderEnumerator.Current));
         // There are mails and current points to the mail to be uploaded.
         return true;
       }
@@ -724,27 +1697,61 @@ namespace GoogleEmailUploader {
       return false;
     }
 
+    /// <summary>
+    /// True if the mail reader threads could not read some folder to the
+    /// end.
+    /// </summary>
+    internal bool HasReadFailures {
+      get {
+        return this.concurrentMailReader != null &&
+            this.concurrentMailReader.HasReadFailures;
+      }
+    }
+
     internal bool MoveToNextMail() {
       while (true) {
         this.DisposeCurrentMail();
-        if (this.currentFolderEnumerator == null ||
-            !this.currentFolderEnumerator.MoveNext()) {
-          if (!this.MoveToNextNonEmptySelectedFolder()) {
+        if (this.concurrentMailReader != null) {
+          ReadMailDatum readMailDatum =
+              this.concurrentMailReader.TakeReadMail();
+          if (readMailDatum == null) {
+            this.currentFolderModel = null;
             return false;
           }
+          // The reader threads skip the uploaded mails.
+          this.currentFolderModel = readMailDatum.FolderModel;
+          this.currentMail = readMailDatum.Mail;
+          this.currentMailStream = readMailDatum.MailStream;
+        } else {
+          if (this.currentFolderEnumerator == null ||
+              !this.currentFolderEnumerator.MoveNext()) {
+            if (!this.MoveToNextNonEmptySelectedFolder()) {
+              return false;
+            }
+          }
+          this.currentMail = (IMail)this.currentFolderEnumerator.Current;
+          if (this.currentFolderModel.IsUploaded(this.currentMail.MailId)) {
+            continue;
+          }
+          if (!MailIterator.IsKnownToBeTooLarge(this.currentMail)) {
+            this.currentMailStream = this.currentMail.OpenRfc822Stream();
+          }
         }
-        this.currentMail = (IMail)this.currentFolderEnumerator.Current;
-        if (this.currentFolderModel.IsUploaded(this.currentMail.MailId)) {
-          continue;
-        }
-        byte[] rfcByteBuffer = this.currentMail.Rfc822Buffer;
-        if (rfcByteBuffer.Length >= 0 &&
-            rfcByteBuffer.Length <=
-                GoogleEmailUploaderConfig.MaximumBatchSize) {
+        string mailHead;
+        if (this.currentMailStream == null) {
+          // We have only the size from the client to go by, as the mail was
+          // not converted.
+          mailHead =
+              string.Format("Folder: {0}\r\nSize: {1} bytes\r\n...",
+                            this.currentFolderModel.Folder.Name,
+                            this.currentMail.MessageSize);
+        } else if (this.currentMailStream.Length <=
+                       GoogleEmailUploaderConfig.MaximumBatchSize) {
           return true;
+        } else {
+          mailHead = MailBatch.GetMailHeader(this.currentMailStream);
         }
         this.failedMailIncrementDelegate();
-        string mailHead = MailBatch.GetMailHeader(this.currentMail);
         FailedMailDatum failedMailDatum =
             new FailedMailDatum(
                 mailHead,
@@ -756,12 +1763,52 @@ namespace GoogleEmailUploader {
       }
     }
 
+    /// <summary>
+    /// Returns true if the size of the mail reported by the client is beyond
+    /// the maximum batch size. The rfc822 encoding is usually larger than
+    /// that size, so such mails are failed without converting them. The
+    /// mails that pass are checked again after conversion.
+    /// </summary>
+    internal static bool IsKnownToBeTooLarge(IMail mail) {
+      return mail.MessageSize >
+          (uint)GoogleEmailUploaderConfig.MaximumBatchSize;
+    }
+
+    /// <summary>
+    /// Returns the resume mark of the mail, or null if it has none.
+    /// </summary>
+    internal static string GetResumeMark(IMail mail) {
+      IResumableMail resumableMail = mail as IResumableMail;
+      if (resumableMail == null) {
+        return null;
+      }
+      return resumableMail.ResumeMark;
+    }
+
     internal IMail CurrentMail {
       get {
         return this.currentMail;
       }
     }
 
+    /// <summary>
+    /// The rfc822 stream of the current mail. This is closed when the
+    /// iterator moves past the current mail.
+    /// </summary>
+    internal Stream CurrentMailStream {
+      get {
+        return this.currentMailStream;
+      }
+    }
+
+    /// <summary>
+    /// Hands the rfc822 stream of the current mail over to the caller, who
+    /// closes it instead of the iterator.
+    /// </summary>
+    internal void DetachCurrentMailStream() {
+      this.currentMailStream = null;
+    }
+
     internal FolderModel CurrentFolderModel {
       get {
         return this.currentFolderModel;
@@ -982,6 +2029,14 @@ namespace GoogleEmailUploader {
     uint failedEmailCount;
     int pauseTime;
     double uploadMailsPerMilliSecond = 0.0009; // mails per millisecond
+    // The mail batches are numbered as they are filled. When several
+    // batches are uploaded at the same time their results are recorded in
+    // that order, so that a resume mark never moves past a mail that is
+    // still being sent. Once a batch is given up on without a result the
+    // order is abandoned and the resume marks are left alone.
+    uint filledMailBatchCount;
+    uint recordedMailBatchCount;
+    bool isMailBatchOrderAbandoned;
 
     public static void LoadClientFactories() {
       try {
@@ -1155,12 +2210,17 @@ namespace GoogleEmailUploader {
               this.flatFolderModelList,
               new VoidDelegate(this.IncrementFailedMailCount));
       this.useCurrent = false;
+      this.filledMailBatchCount = 0;
+      this.recordedMailBatchCount = 0;
+      this.isMailBatchOrderAbandoned = false;
       this.pauseTime = GoogleEmailUploaderConfig.MinimumPauseTime;
       this.modelState = ModelState.Uploading;
     }
 
     void IncrementFailedMailCount() {
-      this.failedEmailCount++;
+      lock (this) {
+        this.failedEmailCount++;
+      }
     }
 
     /// <summary>
@@ -1698,18 +2758,41 @@ namespace GoogleEmailUploader {
       }
     }
 
+    /// <summary>
+    /// Time the upload threads have waited to keep within the upload rate,
+    /// summed over the threads.
+    /// </summary>
+    public TimeSpan UploadThrottledTime {
+      get {
+        return this.mailUploader.RateLimiter.ThrottledTime;
+      }
+    }
+
+    /// <summary>
+    /// Time the upload threads have spent sending mails and contacts and
+    /// waiting for the response, summed over the threads.
+    /// </summary>
+    public TimeSpan UploadSendingTime {
+      get {
+        return this.mailUploader.RateLimiter.SendingTime;
+      }
+    }
+
     internal void SetUploadSpeed(double uploadSpeed) {
       this.uploadMailsPerMilliSecond = uploadSpeed;
     }
 
     internal void UpdateUploadSpeed(uint mailCount,
                                     TimeSpan timeTaken) {
-      uint consideredEmailCount =
-          (this.failedEmailCount + this.uploadedEmailCount);
-      double oldTime = consideredEmailCount / this.uploadMailsPerMilliSecond;
-      double totalMails = consideredEmailCount + mailCount;
-      double totalTimeTaken = oldTime + timeTaken.TotalMilliseconds;
-      this.uploadMailsPerMilliSecond = totalMails / totalTimeTaken;
+      lock (this) {
+        uint consideredEmailCount =
+            (this.failedEmailCount + this.uploadedEmailCount);
+        double oldTime =
+            consideredEmailCount / this.uploadMailsPerMilliSecond;
+        double totalMails = consideredEmailCount + mailCount;
+        double totalTimeTaken = oldTime + timeTaken.TotalMilliseconds;
+        this.uploadMailsPerMilliSecond = totalMails / totalTimeTaken;
+      }
     }
 
     void TimedPauseUpload(PauseReason pauseReason) {
@@ -1753,6 +2836,17 @@ namespace GoogleEmailUploader {
       }
     }
 
+    // Pauses the upload for the pause time and doubles the pause time. When
+    // several batches are uploaded at the same time another batch may have
+    // paused the upload already, and this one just waits for it to resume.
+    void TimedPauseUploadOnFailure(PauseReason pauseReason) {
+      if (this.modelState != ModelState.Uploading) {
+        return;
+      }
+      this.TimedPauseUpload(pauseReason);
+      this.RaisePauseTime();
+    }
+
     void OnPause(PauseReason pauseReason) {
       Debug.Assert(this.modelState == ModelState.Uploading);
       try {
@@ -1806,9 +2900,15 @@ namespace GoogleEmailUploader {
       this.lkgStatePersistor.SaveLKGState(this);
     }
 
+    // Called with the model locked. Waits for the batches filled before this
+    // one to be recorded first.
     void ProcessUploadMailBatchData(MailBatch mailBatch) {
       Debug.Assert(this.modelState == ModelState.UploadingPause ||
                    this.modelState == ModelState.Uploading);
+      while (mailBatch.SequenceNumber != this.recordedMailBatchCount &&
+             !this.isMailBatchOrderAbandoned) {
+        Monitor.Wait(this);
+      }
       foreach (MailBatchDatum batchDatum in mailBatch.MailBatchData) {
         if (batchDatum.Uploaded) {
           batchDatum.FolderModel.SuccessfullyUploaded(batchDatum.MailId);
@@ -1821,10 +2921,26 @@ namespace GoogleEmailUploader {
                                                 failedMailDatum);
           this.failedEmailCount++;
         }
+        if (!this.isMailBatchOrderAbandoned) {
+          batchDatum.FolderModel.AdvanceResumeMark(batchDatum.ResumeMark);
+        }
       }
+      this.recordedMailBatchCount++;
+      Monitor.PulseAll(this);
       this.lkgStatePersistor.SaveLKGState(this);
     }
 
+    /// <summary>
+    /// Called when an upload thread gives up on its batch without recording
+    /// it, so that the other threads don't wait for it.
+    /// </summary>
+    internal void AbandonMailBatchOrder() {
+      lock (this) {
+        this.isMailBatchOrderAbandoned = true;
+        Monitor.PulseAll(this);
+      }
+    }
+
     void WriteCurrentStatistics(MailBatch mailBatch) {
       StringBuilder sb = new StringBuilder();
       sb.AppendFormat(
@@ -1848,6 +2964,10 @@ namespace GoogleEmailUploader {
       sb.AppendFormat(
           " UploadTimeRemaining: {0}",
           this.UploadTimeRemaining);
+      sb.AppendFormat(
+          " UploadThrottledTime: {0} UploadSendingTime: {1}",
+          this.UploadThrottledTime,
+          this.UploadSendingTime);
       if (mailBatch != null) {
         sb.AppendFormat(
             " mailBatch.MailCount: {0}",
@@ -1927,8 +3047,12 @@ namespace GoogleEmailUploader {
           bool added =
               mailBatch.AddMail(
                   this.mailIterator.CurrentMail,
+                  this.mailIterator.CurrentMailStream,
                   this.mailIterator.CurrentFolderModel);
           Debug.Assert(added);
+          if (mailBatch.IsStreamed) {
+            this.mailIterator.DetachCurrentMailStream();
+          }
           if (this.MailBatchFillingEvent != null) {
             this.MailBatchFillingEvent(mailBatch,
                                        this.mailIterator.CurrentMail);
@@ -1937,22 +3061,29 @@ namespace GoogleEmailUploader {
         }
         while (this.mailIterator.MoveToNextMail()) {
           this.mailUploader.PauseEvent.WaitOne();
-          if (this.mailIterator.CurrentMail.Rfc822Buffer.Length == 0) {
+          if (this.mailIterator.CurrentMailStream.Length == 0) {
             // If we cant read the mail behave as if we have successfully
             // uploaded the mail.
             this.mailIterator.CurrentFolderModel.SuccessfullyUploaded(
                 this.mailIterator.CurrentMail.MailId);
-            this.uploadedEmailCount++;
+            lock (this) {
+              this.uploadedEmailCount++;
+            }
             continue;
           }
           if (!mailBatch.AddMail(
                   this.mailIterator.CurrentMail,
+                  this.mailIterator.CurrentMailStream,
                   this.mailIterator.CurrentFolderModel)) {
             // we could not add the current mail
             // so record so that we would add it in the next iteration.
             this.useCurrent = true;
             break;
           }
+          if (mailBatch.IsStreamed) {
+            // The batch keeps the stream to write the mail when it is sent.
+            this.mailIterator.DetachCurrentMailStream();
+          }
           if (this.MailBatchFillingEvent != null) {
             this.MailBatchFillingEvent(mailBatch,
                                        this.mailIterator.CurrentMail);
@@ -1962,6 +3093,9 @@ namespace GoogleEmailUploader {
             break;
           }
         }
+        if (mailBatch.MailCount != 0) {
+          mailBatch.SequenceNumber = this.filledMailBatchCount++;
+        }
         if (this.MailBatchFillingEndEvent != null) {
           this.MailBatchFillingEndEvent(mailBatch);
         }
@@ -1972,17 +3106,21 @@ namespace GoogleEmailUploader {
       }
     }
 
+    // The callbacks for the mail batches lock the model, as there can be
+    // several upload threads.
     internal void MailBatchUploadTryStart(MailBatch mailBatch) {
       try {
         GoogleEmailUploaderTrace.EnteringMethod(
             "GoogleEmailUploaderModel.MailBatchUploadStart");
-        if (GoogleEmailUploaderConfig.LogFullXml) {
-          GoogleEmailUploaderTrace.WriteLine("Request Xml:");
-          GoogleEmailUploaderTrace.WriteXml(mailBatch.GetBatchXML());
-        }
-        this.WriteCurrentStatistics(mailBatch);
-        if (this.MailBatchUploadTryStartEvent != null) {
-          this.MailBatchUploadTryStartEvent(mailBatch);
+        lock (this) {
+          if (GoogleEmailUploaderConfig.LogFullXml) {
+            GoogleEmailUploaderTrace.WriteLine("Request Xml:");
+            GoogleEmailUploaderTrace.WriteXml(mailBatch.GetBatchXML());
+          }
+          this.WriteCurrentStatistics(mailBatch);
+          if (this.MailBatchUploadTryStartEvent != null) {
+            this.MailBatchUploadTryStartEvent(mailBatch);
+          }
         }
       } finally {
         GoogleEmailUploaderTrace.ExitingMethod(
@@ -2018,23 +3156,24 @@ namespace GoogleEmailUploader {
       try {
         GoogleEmailUploaderTrace.EnteringMethod(
             "GoogleEmailUploaderModel.HttpRequestFailure");
-        this.WriteCurrentStatistics(null);
+        lock (this) {
+          this.WriteCurrentStatistics(null);
 
-        string headersString = string.Empty;
-        if (httpException.Response != null) {
-          headersString = httpException.Response.Headers;
-        }
-        GoogleEmailUploaderTrace.WriteLine(
-            "Exception: {0}", httpException.Message);
-        GoogleEmailUploaderTrace.WriteLine("Response Headers: {0}",
-                                           headersString);
-        GoogleEmailUploaderTrace.WriteLine("Response message: {0}",
-                                           exceptionResponseString);
-        if (batchUploadResult != UploadResult.Unauthorized &&
-            batchUploadResult != UploadResult.Forbidden &&
-            batchUploadResult != UploadResult.Conflict) {
-          this.TimedPauseUpload(PauseReason.ConnectionFailures);
-          this.RaisePauseTime();
+          string headersString = string.Empty;
+          if (httpException.Response != null) {
+            headersString = httpException.Response.Headers;
+          }
+          GoogleEmailUploaderTrace.WriteLine(
+              "Exception: {0}", httpException.Message);
+          GoogleEmailUploaderTrace.WriteLine("Response Headers: {0}",
+                                             headersString);
+          GoogleEmailUploaderTrace.WriteLine("Response message: {0}",
+                                             exceptionResponseString);
+          if (batchUploadResult != UploadResult.Unauthorized &&
+              batchUploadResult != UploadResult.Forbidden &&
+              batchUploadResult != UploadResult.Conflict) {
+            this.TimedPauseUploadOnFailure(PauseReason.ConnectionFailures);
+          }
         }
       } finally {
         GoogleEmailUploaderTrace.ExitingMethod(
@@ -2097,27 +3236,28 @@ namespace GoogleEmailUploader {
       try {
         GoogleEmailUploaderTrace.EnteringMethod(
             "GoogleEmailUploaderModel.MailBatchUploadFailure");
-        if (GoogleEmailUploaderConfig.LogFullXml) {
-          GoogleEmailUploaderTrace.WriteLine("Response Xml:");
-          GoogleEmailUploaderTrace.WriteXml(mailBatch.ResponseXml);
-        }
-        this.WriteCurrentStatistics(mailBatch);
-        if (batchUploadResult == UploadResult.InternalError ||
-            batchUploadResult == UploadResult.Unknown) {
-          if (this.pauseTime == GoogleEmailUploaderConfig.MaximumPauseTime) {
-            this.ProcessUploadMailBatchData(mailBatch);
-            this.pauseTime = GoogleEmailUploaderConfig.MinimumPauseTime;
-            return false;
+        lock (this) {
+          if (GoogleEmailUploaderConfig.LogFullXml) {
+            GoogleEmailUploaderTrace.WriteLine("Response Xml:");
+            GoogleEmailUploaderTrace.WriteXml(mailBatch.ResponseXml);
           }
-          this.TimedPauseUpload(PauseReason.ServerInternalError);
-          this.RaisePauseTime();
-        } else {
-          GoogleEmailUploaderTrace.WriteLine(
-              "Batch failed with service unavailable");
-          this.TimedPauseUpload(PauseReason.ServiceUnavailable);
-          this.RaisePauseTime();
+          this.WriteCurrentStatistics(mailBatch);
+          if (batchUploadResult == UploadResult.InternalError ||
+              batchUploadResult == UploadResult.Unknown) {
+            if (this.pauseTime ==
+                    GoogleEmailUploaderConfig.MaximumPauseTime) {
+              this.ProcessUploadMailBatchData(mailBatch);
+              this.pauseTime = GoogleEmailUploaderConfig.MinimumPauseTime;
+              return false;
+            }
+            this.TimedPauseUploadOnFailure(PauseReason.ServerInternalError);
+          } else {
+            GoogleEmailUploaderTrace.WriteLine(
+                "Batch failed with service unavailable");
+            this.TimedPauseUploadOnFailure(PauseReason.ServiceUnavailable);
+          }
+          return true;
         }
-        return true;
       } finally {
         GoogleEmailUploaderTrace.ExitingMethod(
             "GoogleEmailUploaderModel.MailBatchUploadFailure");
@@ -2156,12 +3296,14 @@ namespace GoogleEmailUploader {
       try {
         GoogleEmailUploaderTrace.EnteringMethod(
             "GoogleEmailUploaderModel.MailBatchUploaded");
-        this.ProcessUploadMailBatchData(mailBatch);
-        this.WriteCurrentStatistics(mailBatch);
-        if (this.MailBatchUploadedEvent != null) {
-          this.MailBatchUploadedEvent(mailBatch);
+        lock (this) {
+          this.ProcessUploadMailBatchData(mailBatch);
+          this.WriteCurrentStatistics(mailBatch);
+          if (this.MailBatchUploadedEvent != null) {
+            this.MailBatchUploadedEvent(mailBatch);
+          }
+          this.pauseTime = GoogleEmailUploaderConfig.MinimumPauseTime;
         }
-        this.pauseTime = GoogleEmailUploaderConfig.MinimumPauseTime;
       } finally {
         GoogleEmailUploaderTrace.ExitingMethod(
             "GoogleEmailUploaderModel.MailBatchUploaded");
@@ -2169,6 +3311,14 @@ namespace GoogleEmailUploader {
     }
 
     internal void UploadDone(DoneReason doneReason) {
+      if (doneReason == DoneReason.Completed &&
+          this.mailIterator.HasReadFailures) {
+        // Some mails were not read, so the upload is not complete. It goes
+        // on from where it stopped on the next run.
+        GoogleEmailUploaderTrace.WriteLine(
+            "Upload stopped as some folders could not be read");
+        doneReason = DoneReason.Stopped;
+      }
       if (this.UploadDoneEvent != null) {
         this.UploadDoneEvent(doneReason);
       }
@@ -67,6 +67,14 @@ namespace GoogleEmailUploader {
       set;
     }
 
+    /// <summary>
+    /// Sends the content with chunked transfer encoding as it is written to
+    /// the request stream, instead of setting the length up front.
+    /// </summary>
+    bool SendChunked {
+      set;
+    }
+
     /// <summary>
     /// Method to add key value pairs to the request header.
     /// </summary>
@@ -137,6 +145,11 @@ namespace GoogleEmailUploader {
     /// </summary>
     BadRequest,
 
+    /// <summary>
+    /// The server is overloaded or down for maintenance.
+    /// </summary>
+    ServiceUnavailable,
+
     /// <summary>
     /// Corresponds to WebExceptionStatus.ProtocolError which is not one of the
     /// above
@@ -226,6 +239,10 @@ namespace GoogleEmailUploader {
               } else if (httpStatusCode == HttpStatusCode.BadRequest) {
                 httpExceptionStatus = HttpExceptionStatus.BadRequest;
                 break;
+              } else if (httpStatusCode ==
+                             HttpStatusCode.ServiceUnavailable) {
+                httpExceptionStatus = HttpExceptionStatus.ServiceUnavailable;
+                break;
               }
             }
             httpExceptionStatus = HttpExceptionStatus.ProtocolError;
@@ -321,6 +338,18 @@ namespace GoogleEmailUploader {
       }
     }
 
+    bool IHttpRequest.SendChunked {
+      set {
+        if (value) {
+          // Chunked transfer encoding needs HTTP/1.1, and buffering the
+          // request would defeat the purpose.
+          this.httpWebRequest.ProtocolVersion = HttpVersion.Version11;
+          this.httpWebRequest.AllowWriteStreamBuffering = false;
+        }
+        this.httpWebRequest.SendChunked = value;
+      }
+    }
+
     void IHttpRequest.AddToHeader(string key,
                                   string value) {
       try {
@@ -13,6 +13,7 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+using System;
 using System.Collections;
 using System.IO;
 using System.Windows.Forms;
@@ -74,6 +75,7 @@ namespace GoogleEmailUploader {
     const string ContactsElementName = "Contacts";
     const string FolderElementName = "Folder";
     const string MailElementName = "Mail";
+    const string MailKeysElementName = "MailKeys";
     const string MailIdAttrName = "MailId";
     const string ContactElementName = "Contact";
     const string ContactIdAttrName = "ContactId";
@@ -86,6 +88,7 @@ namespace GoogleEmailUploader {
     const string DisplayNameAttrName = "DisplayName";
     const string PathAttrName = "Path";
     const string PersistNameAttrName = "Persist";
+    const string ResumeMarkAttrName = "ResumeMark";
 
     readonly string lkgStateFilePath;
     readonly string emailId;
@@ -181,11 +184,24 @@ namespace GoogleEmailUploader {
       LKGStatePersistor.LoadSelectedState(
           folderXmlElement,
           folderModel);
+      folderModel.AdvanceResumeMark(
+          folderXmlElement.GetAttribute(LKGStatePersistor.ResumeMarkAttrName));
       foreach (XmlNode childXmlNode in folderXmlElement.ChildNodes) {
         XmlElement childXmlElement = childXmlNode as XmlElement;
         if (childXmlElement == null) {
           continue;
         }
+        if (childXmlElement.Name == LKGStatePersistor.MailKeysElementName) {
+          try {
+            folderModel.SuccessfullyUploaded(
+                Convert.FromBase64String(childXmlElement.InnerText));
+          } catch (FormatException) {
+            // Ignore the corrupt keys. Those mails would get uploaded again.
+          }
+          continue;
+        }
+        // Older versions persisted every uploaded mail as a Mail element.
+        // These get converted to keys the next time the state is saved.
         if (childXmlElement.Name != LKGStatePersistor.MailElementName) {
           continue;
         }
@@ -429,23 +445,38 @@ namespace GoogleEmailUploader {
       folderXmlElement.SetAttribute(
           LKGStatePersistor.SelectionStateAttrName,
           folderModel.IsSelected.ToString());
+      // The upload threads record the mails of the folder while we save it,
+      // under the lock of the folder model.
+      lock (folderModel) {
+        if (folderModel.ResumeMark != null) {
+          folderXmlElement.SetAttribute(
+              LKGStatePersistor.ResumeMarkAttrName,
+              folderModel.ResumeMark);
+        }
 
-      foreach (string mailId in folderModel.MailUploadData.Keys) {
-        XmlElement uploadedEmailXmlElement =
-            this.xmlDocument.CreateElement(
-                LKGStatePersistor.MailElementName);
-        folderXmlElement.AppendChild(uploadedEmailXmlElement);
-        uploadedEmailXmlElement.SetAttribute(
-            LKGStatePersistor.MailIdAttrName,
-            mailId);
-        FailedMailDatum failedMailDatum =
-            (FailedMailDatum)folderModel.MailUploadData[mailId];
-        if (failedMailDatum != null) {
-          // In case of failure to upload we set the reason, otherwise not.
-          uploadedEmailXmlElement.SetAttribute(
+        // The uploaded mails are persisted as one blob of packed keys.
+        if (folderModel.UploadedMailIds.Count > 0) {
+          XmlElement mailKeysXmlElement =
+              this.xmlDocument.CreateElement(
+                  LKGStatePersistor.MailKeysElementName);
+          folderXmlElement.AppendChild(mailKeysXmlElement);
+          mailKeysXmlElement.InnerText =
+              Convert.ToBase64String(folderModel.UploadedMailIds.ToByteArray());
+        }
+        foreach (string mailId in folderModel.FailedMailData.Keys) {
+          XmlElement failedEmailXmlElement =
+              this.xmlDocument.CreateElement(
+                  LKGStatePersistor.MailElementName);
+          folderXmlElement.AppendChild(failedEmailXmlElement);
+          failedEmailXmlElement.SetAttribute(
+              LKGStatePersistor.MailIdAttrName,
+              mailId);
+          FailedMailDatum failedMailDatum =
+              (FailedMailDatum)folderModel.FailedMailData[mailId];
+          failedEmailXmlElement.SetAttribute(
               LKGStatePersistor.FailureReasonAttrName,
               failedMailDatum.FailureReason);
-          uploadedEmailXmlElement.InnerText = failedMailDatum.MailHead;
+          failedEmailXmlElement.InnerText = failedMailDatum.MailHead;
         }
       }
       foreach (FolderModel childFolderModel in folderModel.Children) {
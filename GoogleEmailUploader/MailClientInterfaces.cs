@@ -15,6 +15,7 @@
 
 using System;
 using System.Collections;
+using System.IO;
 using System.Text;
 
 namespace Google.MailClientInterfaces {
@@ -270,6 +271,71 @@ namespace Google.MailClientInterfaces {
     byte[] Rfc822Buffer {
       get;
     }
+
+    /// <summary>
+    /// Opens a readable and seekable stream over the rfc822 encoding of the
+    /// email. Its length is the exact size of the encoding. Unlike
+    /// Rfc822Buffer this lets the consumer read big mails in chunks. In case
+    /// of failure to read the message this returns an empty stream. The
+    /// caller should close the stream when done.
+    /// </summary>
+    Stream OpenRfc822Stream();
+  }
+
+  /// <summary>
+  /// Implemented by folders that can skip the mails processed in an earlier
+  /// run. The folder enumerates its mails in the order of their resume
+  /// marks.
+  /// </summary>
+  public interface IResumableFolder {
+    /// <summary>
+    /// Enumerates the mails whose resume mark is not less than the given
+    /// mark, along with the mails added to the folder after that mark was
+    /// handed out. Mails without a resume mark are always included. If the
+    /// mark no longer matches the folder, all its mails are enumerated.
+    /// </summary>
+    IEnumerable GetMailsFrom(string resumeMark);
+  }
+
+  /// <summary>
+  /// Implemented by mails of folders that implement IResumableFolder.
+  /// </summary>
+  public interface IResumableMail {
+    /// <summary>
+    /// Position of the mail in the folder. Marks compare in ordinal string
+    /// order. This is null if the mail does not have a position.
+    /// </summary>
+    string ResumeMark {
+      get;
+    }
+  }
+
+  /// <summary>
+  /// Implemented by stores whose folders can be read on several threads at
+  /// once. Each thread reads through its own session.
+  /// </summary>
+  public interface IConcurrentStore {
+    /// <summary>
+    /// Opens a new session on the store. The session is meant to be used and
+    /// disposed by one thread only, and is independent of the sessions of
+    /// the other threads.
+    /// </summary>
+    IMailSession OpenMailSession();
+  }
+
+  /// <summary>
+  /// A session opened by IConcurrentStore.
+  /// </summary>
+  public interface IMailSession : IDisposable {
+    /// <summary>
+    /// Enumerates the mails of the given folder of the store through this
+    /// session, like IFolder.Mails or IResumableFolder.GetMailsFrom when
+    /// resumeMark is not null. Only the enumeration returned by the last call
+    /// can be used. The streams of the mails stay valid after the session
+    /// moves on to another folder.
+    /// </summary>
+    IEnumerable GetMails(IFolder folder,
+                         string resumeMark);
   }
 
   /// <summary>
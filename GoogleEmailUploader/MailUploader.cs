@@ -29,15 +29,18 @@ namespace GoogleEmailUploader {
     internal readonly FolderModel FolderModel;
     internal readonly string MailId;
     internal readonly string MessageHead;
+    internal readonly string ResumeMark;
     bool uploaded;
     string failedReason;
 
     internal MailBatchDatum(FolderModel folderModel,
                             string mailId,
-                            string messageHead) {
+                            string messageHead,
+                            string resumeMark) {
       this.FolderModel = folderModel;
       this.MailId = mailId;
       this.MessageHead = messageHead;
+      this.ResumeMark = resumeMark;
       this.uploaded = true;
     }
 
@@ -59,6 +62,51 @@ namespace GoogleEmailUploader {
     }
   }
 
+  /// <summary>
+  /// What goes into the entry of a mail in the batch. A streamed batch keeps
+  /// these to write the entries each time it is sent, so the rfc822 stream
+  /// stays open till the batch is done with.
+  /// </summary>
+  class MailEntryDatum {
+    // The xml elements around the rfc822 of the mail.
+    const int EntryOverhead = 1024;
+
+    internal readonly Stream Rfc822Stream;
+    internal readonly bool IsXmlText;
+    internal readonly bool IsRead;
+    internal readonly bool IsStarred;
+    internal readonly IFolder Folder;
+    internal readonly FolderModel FolderModel;
+
+    internal MailEntryDatum(Stream rfc822Stream,
+                            bool isXmlText,
+                            bool isRead,
+                            bool isStarred,
+                            IFolder folder,
+                            FolderModel folderModel) {
+      this.Rfc822Stream = rfc822Stream;
+      this.IsXmlText = isXmlText;
+      this.IsRead = isRead;
+      this.IsStarred = isStarred;
+      this.Folder = folder;
+      this.FolderModel = folderModel;
+    }
+
+    /// <summary>
+    /// The length of the entry, taking base64 to add a third and the
+    /// escapes in text to add nothing.
+    /// </summary>
+    internal long EstimatedLength {
+      get {
+        long rfc822Length = this.Rfc822Stream.Length;
+        if (!this.IsXmlText) {
+          rfc822Length = (rfc822Length + 2) / 3 * 4;
+        }
+        return rfc822Length + MailEntryDatum.EntryOverhead;
+      }
+    }
+  }
+
   /// <summary>
   /// This represents a set of mails to be loaded at a time. We build XML
   /// representation of DMAPI batch using the mails added.
@@ -98,6 +146,18 @@ This is an upload test mail.
     const string ServiceUnavailableHttpCode = "503";
 
     const int DefaultCopyStepSize = 16 * 1024;
+    // This is a multiple of 3 so that every chunk except the last one is
+    // base64 encoded without padding.
+    const int RawCopyStepSize = 3 * MailBatch.DefaultCopyStepSize;
+    const int Base64CopyStepSize = 4 * MailBatch.DefaultCopyStepSize;
+    // What the length of a streamed batch is estimated to be before the
+    // mails are added.
+    const int StreamedFeedOverhead = 512;
+    static readonly byte[] Base64Alphabet = Encoding.ASCII.GetBytes(
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/");
+    // Maps 12 bits of input to the 2 base64 characters for them, so that 3
+    // bytes are encoded with 2 lookups.
+    static readonly byte[] Base64PairTable = MailBatch.BuildBase64PairTable();
     static readonly bool[] IsPrintableAscii = {
       false,   // 0x00
       false,   // 0x01
@@ -239,10 +299,22 @@ This is an upload test mail.
     readonly GoogleEmailUploaderModel GoogleEmailUploaderModel;
     readonly MemoryStream MemoryStream;
     readonly char[] MemoryBufferArray;
+    readonly byte[] RawBufferArray;
+    readonly byte[] Base64BufferArray;
+    // The mails of a streamed batch.
+    readonly ArrayList MailEntryData;
     uint mailCount;
     FolderModel lastAddedFolderModel;
     XmlTextWriter batchXmlTextWriter;
+    // The stream batchXmlTextWriter writes to.
+    Stream batchStream;
+    bool isStreamed;
+    long streamedLength;
     DateTime startDateTime;
+    uint sequenceNumber;
+    // The size and number of mails the batch is filled up to.
+    int batchSizeLimit;
+    int mailCountLimit;
 
     string responseXml;
     uint failedCount;
@@ -250,10 +322,18 @@ This is an upload test mail.
 
     internal MailBatch(GoogleEmailUploaderModel googleEmailUploaderModel) {
       this.GoogleEmailUploaderModel = googleEmailUploaderModel;
+      // A streamed batch does not need the buffer.
       this.MemoryStream = new MemoryStream(
-          GoogleEmailUploaderConfig.MaximumBatchSize);
+          GoogleEmailUploaderConfig.StreamMailBatches ?
+              0 :
+              GoogleEmailUploaderConfig.MaximumBatchSize);
       this.MemoryBufferArray = new char[MailBatch.DefaultCopyStepSize];
+      this.RawBufferArray = new byte[MailBatch.RawCopyStepSize];
+      this.Base64BufferArray = new byte[MailBatch.Base64CopyStepSize];
       this.MailBatchData = new ArrayList();
+      this.MailEntryData = new ArrayList();
+      this.batchSizeLimit = GoogleEmailUploaderConfig.NormalBatchSize;
+      this.mailCountLimit = GoogleEmailUploaderConfig.MaximumMailsPerBatch;
     }
 
     public uint MailCount {
@@ -268,12 +348,28 @@ This is an upload test mail.
       }
     }
 
+    /// <summary>
+    /// The length of the batch. For a streamed batch this is an estimate.
+    /// </summary>
     public long Length {
       get {
+        if (this.isStreamed) {
+          return this.streamedLength;
+        }
         return this.MemoryStream.Length;
       }
     }
 
+    /// <summary>
+    /// True if the batch is written straight to the request each time it is
+    /// sent. The length of such a batch is not known up front.
+    /// </summary>
+    public bool IsStreamed {
+      get {
+        return this.isStreamed;
+      }
+    }
+
     public FolderModel LastAddedFolderModel {
       get {
         return this.lastAddedFolderModel;
@@ -281,13 +377,24 @@ This is an upload test mail.
     }
 
     public void CopyTo(Stream stream) {
-      this.MemoryStream.WriteTo(stream);
+      if (!this.isStreamed) {
+        this.MemoryStream.WriteTo(stream);
+        return;
+      }
+      this.StartFeed(stream);
+      for (int i = 0; i < this.MailEntryData.Count; ++i) {
+        this.WriteEntry((uint)i,
+                        (MailEntryDatum)this.MailEntryData[i]);
+      }
+      this.FinishFeed();
     }
 
     internal void CreateTestBatch() {
       this.MemoryStream.Position = 0;
       this.MemoryStream.SetLength(0);
       this.MailBatchData.Clear();
+      this.ReleaseStreamedMails();
+      this.isStreamed = false;
       this.mailCount = 1;
       byte[] uploadBuffer = new byte[MailBatch.UploadTestString.Length];
       uploadBuffer = Encoding.UTF8.GetBytes(MailBatch.UploadTestString);
@@ -298,18 +405,47 @@ This is an upload test mail.
       MailBatchDatum batchData =
           new MailBatchDatum(null,
                              String.Empty,
-                             String.Empty);
+                             String.Empty,
+                             null);
       this.MailBatchData.Add(batchData);
     }
 
-    internal void StartBatch() {
+    /// <summary>
+    /// Starts a new batch that is filled up to the given size and number of
+    /// mails. A single mail bigger than the size still makes a batch.
+    /// </summary>
+    internal void StartBatch(int batchSizeLimit,
+                             int mailCountLimit) {
+      this.batchSizeLimit = batchSizeLimit;
+      this.mailCountLimit = mailCountLimit;
       this.MemoryStream.Position = 0;
       this.MemoryStream.SetLength(0);
       this.mailCount = 0;
       this.MailBatchData.Clear();
+      this.ReleaseStreamedMails();
       this.lastAddedFolderModel = null;
-      this.batchXmlTextWriter = new XmlTextWriter(this.MemoryStream,
-                                             Encoding.UTF8);
+      this.isStreamed = GoogleEmailUploaderConfig.StreamMailBatches;
+      if (!this.isStreamed) {
+        this.StartFeed(this.MemoryStream);
+      }
+      this.startDateTime = DateTime.Now;
+    }
+
+    /// <summary>
+    /// Closes the rfc822 streams kept by a streamed batch.
+    /// </summary>
+    internal void ReleaseStreamedMails() {
+      foreach (MailEntryDatum entry in this.MailEntryData) {
+        entry.Rfc822Stream.Close();
+      }
+      this.MailEntryData.Clear();
+      this.streamedLength = MailBatch.StreamedFeedOverhead;
+    }
+
+    void StartFeed(Stream stream) {
+      this.batchStream = stream;
+      this.batchXmlTextWriter = new XmlTextWriter(stream,
+                                                  Encoding.UTF8);
       this.batchXmlTextWriter.Formatting = Formatting.Indented;
       // Start the document
       this.batchXmlTextWriter.WriteStartDocument();
@@ -325,7 +461,6 @@ This is an upload test mail.
                                                    "batch",
                                                    MailBatch.XmlNS,
                                                    MailBatch.GDataBatchNS);
-      this.startDateTime = DateTime.Now;
     }
 
     static bool IsAncestor(IFolder folder,
@@ -339,27 +474,230 @@ This is an upload test mail.
       return false;
     }
 
-    internal unsafe bool AddMail(IMail mail,
-                                 FolderModel folderModel) {
-      byte[] rfc822Buffer = mail.Rfc822Buffer;
-      Debug.Assert(rfc822Buffer.Length > 0 &&
-          rfc822Buffer.Length <= GoogleEmailUploaderConfig.MaximumBatchSize);
-      bool canAdd = (
-          // If its multimail batch let it be almost default mail batch size
-          this.mailCount > 0 &&
-          this.MemoryStream.Length + rfc822Buffer.Length + 2048
-            <= GoogleEmailUploaderConfig.NormalBatchSize &&
-          this.mailCount < GoogleEmailUploaderConfig.MaximumMailsPerBatch
-        ) || (
-          // If this mail is HUGE then its ok to be in singleton batch.
-          this.mailCount == 0 &&
-          rfc822Buffer.Length <=
-              GoogleEmailUploaderConfig.MaximumBatchSize);
+    // Reads till the buffer is full or the stream ends. Returns the number of
+    // bytes read.
+    static int ReadChunk(Stream stream,
+                         byte[] buffer,
+                         int count) {
+      int readCount = 0;
+      while (readCount < count) {
+        int read = stream.Read(buffer,
+                               readCount,
+                               count - readCount);
+        if (read <= 0) {
+          break;
+        }
+        readCount += read;
+      }
+      return readCount;
+    }
 
-      if (!canAdd) {
-        return false;
+    // Returns the index of the first byte from index on that is not
+    // printable ascii, or count if there is none. The bytes are looked at 8
+    // at a time while they are all between 0x20 and 0x7E.
+    static unsafe int SkipPrintableAscii(byte[] buffer,
+                                         int index,
+                                         int count) {
+      fixed (byte* bufferStart = buffer) {
+        byte* current = bufferStart + index;
+        byte* end = bufferStart + count;
+        while (current < end) {
+          if (end - current >= 8) {
+            ulong word = *(ulong*)current;
+            // The high bit of a byte is set in belowSpace if the byte is
+            // below 0x20, and in aboveTilde if it is 0x7F or above. Borrows
+            // and carries can only mark bytes after one that is really
+            // marked.
+            ulong belowSpace = (word - 0x2020202020202020) & ~word;
+            ulong aboveTilde = (word + 0x0101010101010101) | word;
+            if (((belowSpace | aboveTilde) & 0x8080808080808080) == 0) {
+              current += 8;
+              continue;
+            }
+          }
+          // Look at the bytes of this word one by one. Tabs and line
+          // breaks are printable too.
+          byte* wordEnd = end - current >= 8 ? current + 8 : end;
+          for (; current < wordEnd; ++current) {
+            byte b = *current;
+            if (b >= 0x80 ||
+                !MailBatch.IsPrintableAscii[b]) {
+              return (int)(current - bufferStart);
+            }
+          }
+        }
+      }
+      return count;
+    }
+
+    static bool IsXmlCodePoint(int codePoint) {
+      return codePoint < 0xD800 ||
+             (codePoint >= 0xE000 && codePoint <= 0xFFFD) ||
+             (codePoint >= 0x10000 && codePoint <= 0x10FFFF);
+    }
+
+    // Returns true if the mail is valid utf8 and has only characters that
+    // are legal in xml, in which case it can be embedded in the batch as
+    // text. Otherwise it has to be base64 encoded, which makes it a third
+    // bigger on the wire.
+    bool IsXmlText(Stream rfc822Stream) {
+      rfc822Stream.Position = 0;
+      // The state of the utf8 sequence being decoded, which can go across
+      // chunks.
+      int continuationCount = 0;
+      int codePoint = 0;
+      int minimumCodePoint = 0;
+      byte[] buffer = this.RawBufferArray;
+      while (true) {
+        int readCount = MailBatch.ReadChunk(rfc822Stream,
+                                            buffer,
+                                            buffer.Length);
+        if (readCount == 0) {
+          return continuationCount == 0;
+        }
+        int i = 0;
+        while (i < readCount) {
+          int b;
+          if (continuationCount == 0) {
+            i = MailBatch.SkipPrintableAscii(buffer, i, readCount);
+            if (i == readCount) {
+              break;
+            }
+            b = buffer[i++];
+            // Below 0xC2 we have control characters, continuation bytes
+            // without a start and the starts of overlong sequences.
+            if (b < 0xC2) {
+              return false;
+            } else if (b < 0xE0) {
+              continuationCount = 1;
+              codePoint = b & 0x1F;
+              minimumCodePoint = 0x80;
+            } else if (b < 0xF0) {
+              continuationCount = 2;
+              codePoint = b & 0x0F;
+              minimumCodePoint = 0x800;
+            } else if (b < 0xF5) {
+              continuationCount = 3;
+              codePoint = b & 0x07;
+              minimumCodePoint = 0x10000;
+            } else {
+              return false;
+            }
+          } else {
+            b = buffer[i++];
+            if ((b & 0xC0) != 0x80) {
+              return false;
+            }
+            codePoint = (codePoint << 6) | (b & 0x3F);
+            continuationCount--;
+            if (continuationCount == 0 &&
+                (codePoint < minimumCodePoint ||
+                 !MailBatch.IsXmlCodePoint(codePoint))) {
+              return false;
+            }
+          }
+        }
+      }
+    }
+
+    static byte[] BuildBase64PairTable() {
+      byte[] pairTable = new byte[2 * 4096];
+      for (int i = 0; i < 4096; ++i) {
+        pairTable[2 * i] = MailBatch.Base64Alphabet[i >> 6];
+        pairTable[2 * i + 1] = MailBatch.Base64Alphabet[i & 0x3f];
+      }
+      return pairTable;
+    }
+
+    // Encodes count bytes of input into output, padding the last group.
+    // Returns the number of bytes written, which is 4 for every 3 bytes
+    // rounded up.
+    static int EncodeBase64(byte[] input,
+                            int count,
+                            byte[] output) {
+      byte[] pairTable = MailBatch.Base64PairTable;
+      int groupsEnd = count - count % 3;
+      int outputIndex = 0;
+      for (int i = 0; i < groupsEnd; i += 3) {
+        int group = (input[i] << 16) | (input[i + 1] << 8) | input[i + 2];
+        int high = (group >> 12) << 1;
+        int low = (group & 0xfff) << 1;
+        output[outputIndex] = pairTable[high];
+        output[outputIndex + 1] = pairTable[high + 1];
+        output[outputIndex + 2] = pairTable[low];
+        output[outputIndex + 3] = pairTable[low + 1];
+        outputIndex += 4;
       }
+      int remainingCount = count - groupsEnd;
+      if (remainingCount != 0) {
+        byte[] alphabet = MailBatch.Base64Alphabet;
+        int group = input[groupsEnd] << 16;
+        if (remainingCount == 2) {
+          group |= input[groupsEnd + 1] << 8;
+        }
+        output[outputIndex] = alphabet[group >> 18];
+        output[outputIndex + 1] = alphabet[(group >> 12) & 0x3f];
+        if (remainingCount == 2) {
+          output[outputIndex + 2] = alphabet[(group >> 6) & 0x3f];
+        } else {
+          output[outputIndex + 2] = (byte)'=';
+        }
+        output[outputIndex + 3] = (byte)'=';
+        outputIndex += 4;
+      }
+      return outputIndex;
+    }
 
+    // The base64 text is ascii, so it is written straight into the batch
+    // stream instead of going through the xml writer and its utf8 encoder.
+    // This produces the same bytes as XmlTextWriter.WriteBase64.
+    void WriteBase64(Stream rfc822Stream) {
+      // Close the start tag and flush what the writer has buffered.
+      this.batchXmlTextWriter.WriteRaw(string.Empty);
+      this.batchXmlTextWriter.Flush();
+      rfc822Stream.Position = 0;
+      while (true) {
+        int readCount = MailBatch.ReadChunk(rfc822Stream,
+                                            this.RawBufferArray,
+                                            this.RawBufferArray.Length);
+        if (readCount == 0) {
+          return;
+        }
+        int encodedCount = MailBatch.EncodeBase64(this.RawBufferArray,
+                                                  readCount,
+                                                  this.Base64BufferArray);
+        this.batchStream.Write(this.Base64BufferArray,
+                               0,
+                               encodedCount);
+      }
+    }
+
+    void WriteUtf8String(Stream rfc822Stream) {
+      rfc822Stream.Position = 0;
+      Decoder utf8Decoder = Encoding.UTF8.GetDecoder();
+      // The decoder can flush one pending char on top of what the chunk
+      // decodes to, so we leave room for it.
+      int chunkSize = this.MemoryBufferArray.Length - 1;
+      while (true) {
+        int readCount = MailBatch.ReadChunk(rfc822Stream,
+                                            this.RawBufferArray,
+                                            chunkSize);
+        if (readCount == 0) {
+          return;
+        }
+        int charCount = utf8Decoder.GetChars(this.RawBufferArray,
+                                             0,
+                                             readCount,
+                                             this.MemoryBufferArray,
+                                             0);
+        this.batchXmlTextWriter.WriteChars(this.MemoryBufferArray,
+                                           0,
+                                           charCount);
+      }
+    }
+
+    void WriteEntry(uint batchId,
+                    MailEntryDatum entry) {
       this.batchXmlTextWriter.WriteStartElement(MailBatch.EntryElementName,
                                                 MailBatch.AtomNS);
       {
@@ -376,58 +714,45 @@ This is an upload test mail.
       {
         this.batchXmlTextWriter.WriteStartElement(MailBatch.IdElementName,
                                                   MailBatch.GDataBatchNS);
-        this.batchXmlTextWriter.WriteString(this.mailCount.ToString());
+        this.batchXmlTextWriter.WriteString(batchId.ToString());
         this.batchXmlTextWriter.WriteEndElement();
       }
       // Write out rfc822...
+      // The message is read from the stream in chunks so that we never hold
+      // a second full copy of it apart from the one in the batch.
       {
-        bool containsNonPrintASCII = false;
-        // This test is rough. utf8 is multi byte, so having the illegal xml
-        // byte need not mean its illegal xml. We could send every thing as
-        // base64. This just helps us to optimize saving bytes on the wire.
-        for (int i = 0; i < rfc822Buffer.Length; ++i) {
-          byte b = rfc822Buffer[i];
-          if (b >= 0x80 ||
-              !MailBatch.IsPrintableAscii[b]) {
-            containsNonPrintASCII = true;
-            break;
-          }
-        }
         this.batchXmlTextWriter.WriteStartElement("rfc822Msg",
                                                   MailBatch.AppsNS);
-        if (containsNonPrintASCII) {
-          // If the rfc822 contains illegal xml chars then
+        if (!entry.IsXmlText) {
+          // If the rfc822 is not utf8 or contains illegal xml chars then
           // we use base64 encoding.
           this.batchXmlTextWriter.WriteAttributeString("encoding",
                                                        "base64");
-          this.batchXmlTextWriter.WriteBase64(rfc822Buffer,
-                                              0,
-                                              rfc822Buffer.Length);
+          this.WriteBase64(entry.Rfc822Stream);
         } else {
           // Otherwise we embed the rfc as is.
-          string rfcString = Encoding.UTF8.GetString(rfc822Buffer);
-          this.batchXmlTextWriter.WriteString(rfcString);
+          this.WriteUtf8String(entry.Rfc822Stream);
         }
         this.batchXmlTextWriter.WriteEndElement();
       }
       // Write out mail item properties except IS_TRASH. We will not move
       // anything to Trash folder as it automatically empties the Trash.
       {
-        if (!mail.IsRead) {
+        if (!entry.IsRead) {
           this.batchXmlTextWriter.WriteStartElement("mailItemProperty",
                                                     MailBatch.AppsNS);
           this.batchXmlTextWriter.WriteAttributeString("value",
                                                        "IS_UNREAD");
           this.batchXmlTextWriter.WriteEndElement();
         }
-        if (mail.IsStarred) {
+        if (entry.IsStarred) {
           this.batchXmlTextWriter.WriteStartElement("mailItemProperty",
                                                     MailBatch.AppsNS);
           this.batchXmlTextWriter.WriteAttributeString("value",
                                                        "IS_STARRED");
           this.batchXmlTextWriter.WriteEndElement();
         }
-        if (MailBatch.IsAncestor(mail.Folder, FolderKind.Inbox) &&
+        if (MailBatch.IsAncestor(entry.Folder, FolderKind.Inbox) &&
             !this.GoogleEmailUploaderModel.IsArchiveEverything) {
           this.batchXmlTextWriter.WriteStartElement("mailItemProperty",
                                                     MailBatch.AppsNS);
@@ -435,14 +760,14 @@ This is an upload test mail.
                                                        "IS_INBOX");
           this.batchXmlTextWriter.WriteEndElement();
         }
-        if (MailBatch.IsAncestor(mail.Folder, FolderKind.Sent)) {
+        if (MailBatch.IsAncestor(entry.Folder, FolderKind.Sent)) {
           this.batchXmlTextWriter.WriteStartElement("mailItemProperty",
                                                     MailBatch.AppsNS);
           this.batchXmlTextWriter.WriteAttributeString("value",
                                                        "IS_SENT");
           this.batchXmlTextWriter.WriteEndElement();
         }
-        if (MailBatch.IsAncestor(mail.Folder, FolderKind.Draft)) {
+        if (MailBatch.IsAncestor(entry.Folder, FolderKind.Draft)) {
           this.batchXmlTextWriter.WriteStartElement("mailItemProperty",
                                                     MailBatch.AppsNS);
           this.batchXmlTextWriter.WriteAttributeString("value",
@@ -453,7 +778,7 @@ This is an upload test mail.
 
       // Write out labels...
       {
-        string[] labels = folderModel.Labels;
+        string[] labels = entry.FolderModel.Labels;
         for (int i = 0; i < labels.Length; ++i) {
           this.batchXmlTextWriter.WriteStartElement("label",
                                                     MailBatch.AppsNS);
@@ -463,42 +788,85 @@ This is an upload test mail.
         }
       }
       this.batchXmlTextWriter.WriteEndElement();
+    }
+
+    internal bool AddMail(IMail mail,
+                          Stream rfc822Stream,
+                          FolderModel folderModel) {
+      long rfc822Length = rfc822Stream.Length;
+      Debug.Assert(rfc822Length > 0 &&
+          rfc822Length <= GoogleEmailUploaderConfig.MaximumBatchSize);
+      bool canAdd = (
+          // If its multimail batch let it be almost default mail batch size
+          this.mailCount > 0 &&
+          this.Length + rfc822Length + 2048 <= this.batchSizeLimit &&
+          this.mailCount < this.mailCountLimit
+        ) || (
+          // If this mail is HUGE then its ok to be in singleton batch.
+          this.mailCount == 0 &&
+          rfc822Length <=
+              GoogleEmailUploaderConfig.MaximumBatchSize);
+
+      if (!canAdd) {
+        return false;
+      }
+
+      MailEntryDatum entry =
+          new MailEntryDatum(rfc822Stream,
+                             this.IsXmlText(rfc822Stream),
+                             mail.IsRead,
+                             mail.IsStarred,
+                             mail.Folder,
+                             folderModel);
+      if (this.isStreamed) {
+        this.MailEntryData.Add(entry);
+        this.streamedLength += entry.EstimatedLength;
+      } else {
+        this.WriteEntry(this.mailCount,
+                        entry);
+      }
 
       this.mailCount++;
       this.lastAddedFolderModel = folderModel;
       MailBatchDatum batchData =
           new MailBatchDatum(folderModel,
                              mail.MailId,
-                             MailBatch.GetMailHeader(mail));
+                             MailBatch.GetMailHeader(rfc822Stream),
+                             MailIterator.GetResumeMark(mail));
       this.MailBatchData.Add(batchData);
       return true;
     }
 
-    internal static string GetMailHeader(IMail mail) {
-      using (MemoryStream memoryStream =
-          new MemoryStream(mail.Rfc822Buffer, false)) {
-        using (StreamReader streamReader = new StreamReader(memoryStream)) {
-          StringBuilder sb = new StringBuilder();
-          int linesRead = 0;
-          while (linesRead
-                    < GoogleEmailUploaderConfig.FailedMailHeadLineCount &&
-                 streamReader.Peek() != -1) {
-            sb.Append(streamReader.ReadLine());
-            sb.Append("\r\n");
-            linesRead++;
-          }
-          sb.Append("...");
-          return sb.ToString();
-        }
+    internal static string GetMailHeader(Stream rfc822Stream) {
+      rfc822Stream.Position = 0;
+      // We do not dispose the reader because that would close the stream,
+      // which is owned by the caller.
+      StreamReader streamReader = new StreamReader(rfc822Stream);
+      StringBuilder sb = new StringBuilder();
+      int linesRead = 0;
+      while (linesRead
+                < GoogleEmailUploaderConfig.FailedMailHeadLineCount &&
+             streamReader.Peek() != -1) {
+        sb.Append(streamReader.ReadLine());
+        sb.Append("\r\n");
+        linesRead++;
       }
+      sb.Append("...");
+      rfc822Stream.Position = 0;
+      return sb.ToString();
     }
 
     internal bool IsBatchFilled() {
-      return this.MemoryStream.Length + 2048 >
-          GoogleEmailUploaderConfig.NormalBatchSize;
+      return this.Length + 2048 > this.batchSizeLimit;
     }
 
     internal void FinishBatch() {
+      if (!this.isStreamed) {
+        this.FinishFeed();
+      }
+    }
+
+    void FinishFeed() {
       // Close the feed
       this.batchXmlTextWriter.WriteEndElement();
       // close the document
@@ -507,9 +875,15 @@ This is an upload test mail.
     }
 
     internal string GetBatchXML() {
-      return Encoding.UTF8.GetString(this.MemoryStream.GetBuffer(),
+      MemoryStream memoryStream = this.MemoryStream;
+      if (this.isStreamed) {
+        // Only used for logging, so we can afford to build the batch here.
+        memoryStream = new MemoryStream();
+        this.CopyTo(memoryStream);
+      }
+      return Encoding.UTF8.GetString(memoryStream.GetBuffer(),
                                      0,
-                                     (int)this.MemoryStream.Length);
+                                     (int)memoryStream.Length);
     }
 
     void GetEntryDetails(XmlElement entryElement,
@@ -646,6 +1020,18 @@ This is an upload test mail.
         return this.startDateTime;
       }
     }
+
+    /// <summary>
+    /// The number of the batch in the order the batches were filled.
+    /// </summary>
+    internal uint SequenceNumber {
+      get {
+        return this.sequenceNumber;
+      }
+      set {
+        this.sequenceNumber = value;
+      }
+    }
   }
 
   /// <summary>
@@ -1429,8 +1815,267 @@ This is an upload test mail.
     Created,
   }
 
-  // This class is meant to be used by a single thread.
-  // That thread will be blocked at GetAvailableMailBatch or UploadBatch
+  // Token bucket that fills at a fixed rate up to the burst. A request can
+  // take more tokens than the bucket holds, leaving it in debt, so the
+  // rate holds in the long run whatever the size of the requests.
+  class TokenBucket {
+    readonly double RatePerMillisecond;
+    readonly double Burst;
+    // The tokens in the bucket at refillTime. It is negative while the
+    // bucket is in debt.
+    double tokens;
+    DateTime refillTime;
+
+    internal TokenBucket(double ratePerSecond,
+                         double burst) {
+      this.RatePerMillisecond = ratePerSecond / 1000;
+      this.Burst = burst;
+      this.tokens = burst;
+      this.refillTime = DateTime.Now;
+    }
+
+    // Returns how long to wait from now till the bucket has the tokens for
+    // the cost. A cost bigger than the burst waits for a full bucket.
+    internal double GetWaitMilliseconds(DateTime now,
+                                        double cost) {
+      double tokens = this.GetTokens(now);
+      double neededTokens = Math.Min(cost, this.Burst);
+      if (tokens >= neededTokens) {
+        return 0;
+      }
+      return (neededTokens - tokens) / this.RatePerMillisecond;
+    }
+
+    internal void Take(DateTime sendTime,
+                       double cost) {
+      this.tokens = this.GetTokens(sendTime) - cost;
+      this.refillTime = sendTime;
+    }
+
+    double GetTokens(DateTime time) {
+      TimeSpan sinceRefill = time - this.refillTime;
+      double tokens =
+          this.tokens +
+              sinceRefill.TotalMilliseconds * this.RatePerMillisecond;
+      return Math.Min(tokens, this.Burst);
+    }
+  }
+
+  /// <summary>
+  /// Keeps the upload within the rate the server takes the mails at, with a
+  /// token bucket for the mails, one for the contacts and one for the bytes
+  /// sent. All the upload threads and the contacts share the limiter. The
+  /// time spent waiting on it and sending is summed over all the threads.
+  /// </summary>
+  class UploadRateLimiter {
+    // Null if there is no limit.
+    readonly TokenBucket MailBucket;
+    readonly TokenBucket ContactBucket;
+    readonly TokenBucket ByteBucket;
+    TimeSpan throttledTime;
+    TimeSpan sendingTime;
+
+    internal UploadRateLimiter() {
+      if (GoogleEmailUploaderConfig.UploadMailsPerMinute > 0) {
+        this.MailBucket =
+            new TokenBucket(
+                GoogleEmailUploaderConfig.UploadMailsPerMinute / 60.0,
+                GoogleEmailUploaderConfig.UploadMailBurst);
+      }
+      if (GoogleEmailUploaderConfig.UploadContactsPerMinute > 0) {
+        this.ContactBucket =
+            new TokenBucket(
+                GoogleEmailUploaderConfig.UploadContactsPerMinute / 60.0,
+                GoogleEmailUploaderConfig.UploadContactBurst);
+      }
+      if (GoogleEmailUploaderConfig.UploadBytesPerSecond > 0) {
+        this.ByteBucket =
+            new TokenBucket(GoogleEmailUploaderConfig.UploadBytesPerSecond,
+                            GoogleEmailUploaderConfig.UploadByteBurst);
+      }
+    }
+
+    /// <summary>
+    /// Waits till the mails and the bytes can be sent.
+    /// </summary>
+    internal void WaitToSendMails(uint mailCount,
+                                  long byteCount) {
+      this.WaitToSend(this.MailBucket, mailCount, byteCount);
+    }
+
+    /// <summary>
+    /// Waits till the contact and the bytes can be sent.
+    /// </summary>
+    internal void WaitToSendContact(long byteCount) {
+      this.WaitToSend(this.ContactBucket, 1, byteCount);
+    }
+
+    // The tokens are taken before waiting, so that the threads calling this
+    // at the same time queue up behind each other.
+    void WaitToSend(TokenBucket countBucket,
+                    uint count,
+                    long byteCount) {
+      double waitMilliseconds = 0;
+      lock (this) {
+        DateTime now = DateTime.Now;
+        if (countBucket != null) {
+          waitMilliseconds = countBucket.GetWaitMilliseconds(now, count);
+        }
+        if (this.ByteBucket != null) {
+          waitMilliseconds =
+              Math.Max(waitMilliseconds,
+                       this.ByteBucket.GetWaitMilliseconds(now, byteCount));
+        }
+        DateTime sendTime = now.AddMilliseconds(waitMilliseconds);
+        if (countBucket != null) {
+          countBucket.Take(sendTime, count);
+        }
+        if (this.ByteBucket != null) {
+          this.ByteBucket.Take(sendTime, byteCount);
+        }
+        this.throttledTime += TimeSpan.FromMilliseconds(waitMilliseconds);
+      }
+      if (waitMilliseconds > 0) {
+        Thread.Sleep(TimeSpan.FromMilliseconds(waitMilliseconds));
+      }
+    }
+
+    internal void AddSendingTime(TimeSpan timeTaken) {
+      lock (this) {
+        this.sendingTime += timeTaken;
+      }
+    }
+
+    internal TimeSpan ThrottledTime {
+      get {
+        lock (this) {
+          return this.throttledTime;
+        }
+      }
+    }
+
+    internal TimeSpan SendingTime {
+      get {
+        lock (this) {
+          return this.sendingTime;
+        }
+      }
+    }
+  }
+
+  /// <summary>
+  /// Sizes the mail batches to the link, the way TCP sizes its window. The
+  /// size and the number of mails grow a step at a time while the batches
+  /// go through within the latency target, and are halved when the server
+  /// is unavailable, the request times out or is cut off, or the batch
+  /// takes longer than the target. The size stays between an eighth of
+  /// NormalBatchSize and MaximumBatchSize, and the number of mails between
+  /// 1 and MaximumMailsPerBatch. Without AdaptMailBatchSize the batches are
+  /// NormalBatchSize and MaximumMailsPerBatch, as before.
+  /// </summary>
+  class MailBatchSizer {
+    readonly int MinimumBatchSize;
+    readonly int BatchSizeStep;
+    int batchSize;
+    int mailCount;
+    // Batches filled before the last decrease were sized for a link that
+    // was doing better, so what happens to them is not counted again.
+    DateTime lastDecreaseTime;
+
+    internal MailBatchSizer() {
+      this.MinimumBatchSize = GoogleEmailUploaderConfig.NormalBatchSize / 8;
+      this.BatchSizeStep = GoogleEmailUploaderConfig.NormalBatchSize / 8;
+      this.batchSize = GoogleEmailUploaderConfig.NormalBatchSize;
+      this.mailCount = GoogleEmailUploaderConfig.MaximumMailsPerBatch;
+      this.lastDecreaseTime = DateTime.MinValue;
+    }
+
+    internal int BatchSize {
+      get {
+        lock (this) {
+          return this.batchSize;
+        }
+      }
+    }
+
+    internal int MailCount {
+      get {
+        lock (this) {
+          return this.mailCount;
+        }
+      }
+    }
+
+    /// <summary>
+    /// Called when the server has responded to the batch.
+    /// </summary>
+    internal void BatchResponded(MailBatch mailBatch,
+                                 UploadResult batchUploadResult,
+                                 TimeSpan latency) {
+      if (batchUploadResult == UploadResult.ServiceUnavailable) {
+        this.Decrease(mailBatch);
+      } else if (batchUploadResult >= UploadResult.BadRequest) {
+        if (latency.TotalSeconds >
+                GoogleEmailUploaderConfig.MailBatchLatencyTarget) {
+          this.Decrease(mailBatch);
+        } else {
+          this.Increase(mailBatch);
+        }
+      }
+    }
+
+    /// <summary>
+    /// Called when the request for the batch failed.
+    /// </summary>
+    internal void BatchFailed(MailBatch mailBatch,
+                              HttpExceptionStatus httpExceptionStatus) {
+      if (httpExceptionStatus == HttpExceptionStatus.ServiceUnavailable ||
+          httpExceptionStatus == HttpExceptionStatus.Timeout ||
+          httpExceptionStatus == HttpExceptionStatus.BadGateway) {
+        this.Decrease(mailBatch);
+      }
+    }
+
+    void Increase(MailBatch mailBatch) {
+      if (!GoogleEmailUploaderConfig.AdaptMailBatchSize) {
+        return;
+      }
+      lock (this) {
+        if (mailBatch.StartDateTime < this.lastDecreaseTime) {
+          return;
+        }
+        this.batchSize =
+            Math.Min(this.batchSize + this.BatchSizeStep,
+                     GoogleEmailUploaderConfig.MaximumBatchSize);
+        this.mailCount =
+            Math.Min(this.mailCount + 1,
+                     GoogleEmailUploaderConfig.MaximumMailsPerBatch);
+      }
+    }
+
+    void Decrease(MailBatch mailBatch) {
+      if (!GoogleEmailUploaderConfig.AdaptMailBatchSize) {
+        return;
+      }
+      lock (this) {
+        if (mailBatch.StartDateTime < this.lastDecreaseTime) {
+          return;
+        }
+        this.batchSize = Math.Max(this.batchSize / 2,
+                                  this.MinimumBatchSize);
+        this.mailCount = Math.Max(this.mailCount / 2, 1);
+        this.lastDecreaseTime = DateTime.Now;
+        GoogleEmailUploaderTrace.WriteLine(
+            "Mail batches cut to {0} bytes and {1} mails",
+            this.batchSize,
+            this.mailCount);
+      }
+    }
+  }
+
+  // The upload runs on UploadThread. When MailUploadThreadCount is more than
+  // 1 the mail batches are uploaded by that many threads, each with its own
+  // MailBatch. The batches are filled one at a time, in order.
   class MailUploader {
     const string ContactMigrationURLTemplate =
         "http://www.google.com/m8/feeds/contacts/{0}/full";
@@ -1449,12 +2094,24 @@ This is an upload test mail.
     readonly string batchMailUploadUrl;
     readonly string batchContactUploadUrl;
     readonly GoogleEmailUploaderModel GoogleEmailUploaderModel;
+    // The batch of UploadThread. It is also used for the test upload.
     readonly MailBatch MailBatch;
     readonly ContactEntry ContactEntry;
     internal readonly ManualResetEvent PauseEvent;
+    internal readonly UploadRateLimiter RateLimiter;
+    readonly MailBatchSizer MailBatchSizer;
     readonly string ApplicationName;
+    // Held while a batch is filled, so that the batches get the mails in
+    // order.
+    readonly object MailBatchFillLock;
 
     Thread UploadThread;
+    // The threads uploading mail batches alongside UploadThread.
+    MailBatchUploadThread[] mailBatchUploadThreads;
+    // The rest are guarded by the lock of the uploader.
+    bool areMailBatchUploadsStopped;
+    DoneReason mailBatchUploadsDoneReason;
+    DateTime lastMailBatchDoneTime;
 
     internal MailUploader(IHttpFactory httpFactory,
                           string emailId,
@@ -1484,6 +2141,9 @@ This is an upload test mail.
       this.MailBatch = new MailBatch(googleEmailUploaderModel);
       this.ContactEntry = new ContactEntry(googleEmailUploaderModel);
       this.PauseEvent = new ManualResetEvent(true);
+      this.MailBatchFillLock = new object();
+      this.RateLimiter = new UploadRateLimiter();
+      this.MailBatchSizer = new MailBatchSizer();
       this.batchMailUploadUrl =
           string.Format(
               GoogleEmailUploaderConfig.EmailMigrationUrl,
@@ -1573,6 +2233,7 @@ This is an upload test mail.
             batchUploadResult = UploadResult.BadGateway;
             break;
           case HttpExceptionStatus.Conflict:
+          case HttpExceptionStatus.ServiceUnavailable:
           case HttpExceptionStatus.ProtocolError:
           case HttpExceptionStatus.Timeout:
           case HttpExceptionStatus.Other:
@@ -1659,6 +2320,7 @@ This is an upload test mail.
           case HttpExceptionStatus.BadGateway:
             uploadResult = UploadResult.BadGateway;
             break;
+          case HttpExceptionStatus.ServiceUnavailable:
           case HttpExceptionStatus.ProtocolError:
           case HttpExceptionStatus.Timeout:
           case HttpExceptionStatus.Other:
@@ -1733,6 +2395,7 @@ This is an upload test mail.
           case HttpExceptionStatus.BadGateway:
             uploadResult = UploadResult.BadGateway;
             break;
+          case HttpExceptionStatus.ServiceUnavailable:
           case HttpExceptionStatus.ProtocolError:
           case HttpExceptionStatus.Timeout:
           case HttpExceptionStatus.Other:
@@ -1759,19 +2422,26 @@ This is an upload test mail.
     }
 
     // Returns true if we need to retry the upload...
-    bool TryUploadEmailBatch(out UploadResult batchUploadResult) {
+    bool TryUploadEmailBatch(MailBatch mailBatch,
+                             out UploadResult batchUploadResult) {
       IHttpResponse httpResponse = null;
       try {
         GoogleEmailUploaderTrace.EnteringMethod(
             "MailUploader.TryUploadBatch");
-        this.GoogleEmailUploaderModel.MailBatchUploadTryStart(this.MailBatch);
+        this.GoogleEmailUploaderModel.MailBatchUploadTryStart(mailBatch);
         IHttpRequest httpRequest =
             this.CreateProperHttpPostRequest(this.batchMailUploadUrl,
                                          this.MailAuthenticationToken);
-        httpRequest.ContentLength = this.MailBatch.Length;
+        if (mailBatch.IsStreamed) {
+          // The batch is written as it is sent.
+          httpRequest.SendChunked = true;
+        } else {
+          httpRequest.ContentLength = mailBatch.Length;
+        }
+        DateTime requestStart = DateTime.Now;
         try {
           using (Stream httpWebRequestStream = httpRequest.GetRequestStream()) {
-            this.MailBatch.CopyTo(httpWebRequestStream);
+            mailBatch.CopyTo(httpWebRequestStream);
           }
         } catch (IOException) {
           batchUploadResult = UploadResult.OtherException;
@@ -1779,21 +2449,26 @@ This is an upload test mail.
         }
         httpResponse = httpRequest.GetResponse();
         using (Stream respStream = httpResponse.GetResponseStream()) {
-          batchUploadResult = this.MailBatch.ProcessResponse(respStream);
+          batchUploadResult = mailBatch.ProcessResponse(respStream);
+          this.MailBatchSizer.BatchResponded(mailBatch,
+                                             batchUploadResult,
+                                             DateTime.Now - requestStart);
           if (batchUploadResult >= UploadResult.BadRequest) {
-            this.GoogleEmailUploaderModel.MailBatchUploaded(this.MailBatch,
+            this.GoogleEmailUploaderModel.MailBatchUploaded(mailBatch,
                                                             batchUploadResult);
             return false;
           } else {
             // Not uploaded. Inform the provider and try again if needed.
             bool tryAgain =
                 this.GoogleEmailUploaderModel.MailBatchUploadFailure(
-                    this.MailBatch,
+                    mailBatch,
                     batchUploadResult);
             return tryAgain;
           }
         }
       } catch (HttpException httpException) {
+        this.MailBatchSizer.BatchFailed(mailBatch,
+                                        httpException.Status);
         switch (httpException.Status) {
           case HttpExceptionStatus.Unauthorized:
             batchUploadResult = UploadResult.Unauthorized;
@@ -1805,6 +2480,7 @@ This is an upload test mail.
             batchUploadResult = UploadResult.BadGateway;
             break;
           case HttpExceptionStatus.Conflict:
+          case HttpExceptionStatus.ServiceUnavailable:
           case HttpExceptionStatus.ProtocolError:
           case HttpExceptionStatus.Timeout:
           case HttpExceptionStatus.Other:
@@ -1831,12 +2507,117 @@ This is an upload test mail.
       }
     }
 
-    // Returns false if mails ended up.
-    bool GetNextEmailBatch() {
-      this.MailBatch.StartBatch();
-      this.GoogleEmailUploaderModel.FillMailBatch(this.MailBatch);
-      this.MailBatch.FinishBatch();
-      return this.MailBatch.MailCount != 0;
+    // Returns false if mails ended up or the mail upload was stopped.
+    bool GetNextEmailBatch(MailBatch mailBatch) {
+      lock (this.MailBatchFillLock) {
+        lock (this) {
+          if (this.areMailBatchUploadsStopped) {
+            return false;
+          }
+        }
+        mailBatch.StartBatch(this.MailBatchSizer.BatchSize,
+                             this.MailBatchSizer.MailCount);
+        this.GoogleEmailUploaderModel.FillMailBatch(mailBatch);
+        mailBatch.FinishBatch();
+        return mailBatch.MailCount != 0;
+      }
+    }
+
+    // Stops all the threads from taking more mail batches. The batches
+    // already being sent are still recorded, but without moving the resume
+    // marks, as an earlier batch may have been given up on.
+    void StopMailBatchUploads(DoneReason doneReason) {
+      lock (this) {
+        if (!this.areMailBatchUploadsStopped) {
+          this.areMailBatchUploadsStopped = true;
+          this.mailBatchUploadsDoneReason = doneReason;
+        }
+      }
+      this.GoogleEmailUploaderModel.AbandonMailBatchOrder();
+    }
+
+    // With several batches in flight the time a batch takes overlaps with
+    // the others, so only the time since the last batch was done counts.
+    void UpdateUploadSpeed(MailBatch mailBatch) {
+      lock (this) {
+        DateTime now = DateTime.Now;
+        DateTime startDateTime = mailBatch.StartDateTime;
+        if (this.lastMailBatchDoneTime > startDateTime) {
+          startDateTime = this.lastMailBatchDoneTime;
+        }
+        this.lastMailBatchDoneTime = now;
+        this.GoogleEmailUploaderModel.UpdateUploadSpeed(
+            mailBatch.MailCount,
+            now - startDateTime);
+      }
+    }
+
+    // Uploads mail batches with the given batch till the mails end up or
+    // the mail upload is stopped. Runs on UploadThread and on each of the
+    // mail batch upload threads.
+    internal void UploadMailBatches(MailBatch mailBatch) {
+      while (this.GetNextEmailBatch(mailBatch)) {
+#if DEBUG
+        string reqXml = mailBatch.GetBatchXML();
+#endif
+        this.RateLimiter.WaitToSendMails(mailBatch.MailCount,
+                                         mailBatch.Length);
+        // Keep trying till succeeds...
+        while (true) {
+          // Wait if we are in pause mode...
+          this.PauseEvent.WaitOne();
+          // Try to upload the mail batch
+          UploadResult batchUploadResult;
+          DateTime start = DateTime.Now;
+          bool retry = this.TryUploadEmailBatch(mailBatch,
+                                                out batchUploadResult);
+          this.RateLimiter.AddSendingTime(DateTime.Now - start);
+          if (retry) {
+            continue;
+          }
+          if (batchUploadResult == UploadResult.Unauthorized) {
+            this.StopMailBatchUploads(DoneReason.Unauthorized);
+            return;
+          } else if (batchUploadResult == UploadResult.Forbidden) {
+            this.StopMailBatchUploads(DoneReason.Forbidden);
+            return;
+          } else {
+            break;
+          }
+        }
+        this.UpdateUploadSpeed(mailBatch);
+      }
+    }
+
+    // Called if a mail batch upload thread ends with an exception.
+    internal void MailBatchUploadThreadFailed() {
+      this.StopMailBatchUploads(DoneReason.Stopped);
+    }
+
+    void StartMailBatchUploadThreads() {
+      int threadCount = GoogleEmailUploaderConfig.MailUploadThreadCount;
+      this.mailBatchUploadThreads = new MailBatchUploadThread[threadCount - 1];
+      for (int i = 0; i < this.mailBatchUploadThreads.Length; ++i) {
+        this.mailBatchUploadThreads[i] =
+            new MailBatchUploadThread(this,
+                                      this.GoogleEmailUploaderModel);
+      }
+    }
+
+    // Waits for the mail batch upload threads, aborting them first if the
+    // upload is not done.
+    void EndMailBatchUploadThreads(bool abort) {
+      if (this.mailBatchUploadThreads == null) {
+        return;
+      }
+      foreach (MailBatchUploadThread uploadThread in
+          this.mailBatchUploadThreads) {
+        if (abort) {
+          uploadThread.Abort();
+        }
+        uploadThread.Join();
+      }
+      this.mailBatchUploadThreads = null;
     }
 
     // Main look that runs of the background thread...
@@ -1852,6 +2633,7 @@ This is an upload test mail.
             break;
           }
           this.ContactEntry.SetContact(contact, storeModel);
+          this.RateLimiter.WaitToSendContact(this.ContactEntry.Length);
           // Keep trying till succeeds...
           while (true) {
 #if DEBUG
@@ -1860,9 +2642,11 @@ This is an upload test mail.
             // Wait if we are in pause mode...
             this.PauseEvent.WaitOne();
             UploadResult uploadResult;
+            DateTime start = DateTime.Now;
             if (this.ContactEntry.UpdateUrl == null) {
               // Try to upload the mail batch
               bool retry = this.TryUploadContactEntry(out uploadResult);
+              this.RateLimiter.AddSendingTime(DateTime.Now - start);
               if (retry) {
                 continue;
               }
@@ -1873,6 +2657,7 @@ This is an upload test mail.
               // Retrying after the conflict was resolved.
               bool retry =
                 this.TryUpdateContactEntry(out uploadResult);
+              this.RateLimiter.AddSendingTime(DateTime.Now - start);
               if (retry) {
                 continue;
               }
@@ -1889,54 +2674,20 @@ This is an upload test mail.
           }
         }
       skipContactsUpload:
-        while (this.GetNextEmailBatch()) {
-#if DEBUG
-          string reqXml = this.MailBatch.GetBatchXML();
-#endif
-          // Keep trying till succeeds...
-          while (true) {
-            // Wait if we are in pause mode...
-            this.PauseEvent.WaitOne();
-            // Try to upload the mail batch
-            UploadResult batchUploadResult;
-            DateTime start = DateTime.Now;
-            bool retry = this.TryUploadEmailBatch(out batchUploadResult);
-            if (retry) {
-              continue;
-            }
-            // we are doign throtlling here
-            // 0.0009 is q per milli secs
-            TimeSpan timeTaken = DateTime.Now - start;
-            int milliSecsToSleep =
-                (int)(this.MailBatch.MailCount / 0.0009
-                    - timeTaken.Milliseconds);
-            if (milliSecsToSleep > 0) {
-              Thread.Sleep(milliSecsToSleep);
-            }
-            if (batchUploadResult == UploadResult.Unauthorized) {
-              doneReason = DoneReason.Unauthorized;
-              goto skipEmailUploads;
-            } else if (batchUploadResult == UploadResult.Forbidden) {
-              doneReason = DoneReason.Forbidden;
-              goto skipEmailUploads;
-            } else {
-              break;
-            }
-          }
-          TimeSpan timeSpan = DateTime.Now - this.MailBatch.StartDateTime;
-          this.GoogleEmailUploaderModel.UpdateUploadSpeed(
-              this.MailBatch.MailCount,
-              timeSpan);
-        }
-        doneReason = DoneReason.Completed;
-      skipEmailUploads:
-        ;
+        this.areMailBatchUploadsStopped = false;
+        this.mailBatchUploadsDoneReason = DoneReason.Completed;
+        this.StartMailBatchUploadThreads();
+        this.UploadMailBatches(this.MailBatch);
+        this.EndMailBatchUploadThreads(false);
+        doneReason = this.mailBatchUploadsDoneReason;
       } catch (ThreadAbortException) {
         //  We catch this exception so that this does not shut down
         //  the application.
       } catch (Exception excep) {
         GoogleEmailUploaderTrace.WriteLine(excep.ToString());
       } finally {
+        this.EndMailBatchUploadThreads(true);
+        this.MailBatch.ReleaseStreamedMails();
         this.UploadThread = null;
         this.GoogleEmailUploaderModel.UploadDone(doneReason);
       }
@@ -1948,5 +2699,42 @@ This is an upload test mail.
       }
     }
   }
-}
 
+  // A thread uploading mail batches alongside the upload thread of the
+  // MailUploader, with its own MailBatch.
+  class MailBatchUploadThread {
+    readonly MailUploader MailUploader;
+    readonly MailBatch MailBatch;
+    readonly Thread Thread;
+
+    internal MailBatchUploadThread(
+        MailUploader mailUploader,
+        GoogleEmailUploaderModel googleEmailUploaderModel) {
+      this.MailUploader = mailUploader;
+      this.MailBatch = new MailBatch(googleEmailUploaderModel);
+      this.Thread = new Thread(new ThreadStart(this.UploadMethod));
+      this.Thread.Start();
+    }
+
+    void UploadMethod() {
+      try {
+        this.MailUploader.UploadMailBatches(this.MailBatch);
+      } catch (ThreadAbortException) {
+        // The upload thread aborts us when the upload is stopped.
+      } catch (Exception excep) {
+        GoogleEmailUploaderTrace.WriteLine(excep.ToString());
+        this.MailUploader.MailBatchUploadThreadFailed();
+      } finally {
+        this.MailBatch.ReleaseStreamedMails();
+      }
+    }
+
+    internal void Abort() {
+      this.Thread.Abort();
+    }
+
+    internal void Join() {
+      this.Thread.Join();
+    }
+  }
+}
@@ -337,7 +337,7 @@ namespace GoogleEmailUploader {
           streamWriter.WriteLine(folderString);
           streamWriter.WriteLine(new string('=', folderString.Length));
           foreach (FailedMailDatum failedMailDatum
-              in folderModel.MailUploadData.Values) {
+              in folderModel.FailedMailData.Values) {
             if (failedMailDatum == null) {
               continue;
             }
@@ -133,6 +133,12 @@ namespace Google.Thunderbird {
       }
     }
 
+    internal static string MboxIndexDirectory {
+      get {
+        return "Google\\GoogleEmailUploader\\ThunderbirdIndex";
+      }
+    }
+
     internal static string CarriageReturn {
       get {
         return "\r\n";
@@ -15,6 +15,7 @@
 
 using System;
 using System.Collections;
+using System.IO;
 using System.Text;
 
 using Google.MailClientInterfaces;
@@ -22,12 +23,29 @@ using Google.MailClientInterfaces;
 namespace Google.Thunderbird {
   internal class ThunderbirdEmailEnumerable : IEnumerable {
     private ThunderbirdFolder folder;
+    private ThunderbirdMboxIndex mboxIndex;
+    private string resumeMark;
 
-    internal ThunderbirdEmailEnumerable(ThunderbirdFolder folder) {
+    // If mboxIndex is null the mbox file is scanned instead, and the resume
+    // mark is not used.
+    internal ThunderbirdEmailEnumerable(ThunderbirdFolder folder,
+                                        ThunderbirdMboxIndex mboxIndex,
+                                        string resumeMark) {
       this.folder = folder;
+      this.mboxIndex = mboxIndex;
+      this.resumeMark = resumeMark;
     }
 
     public IEnumerator GetEnumerator() {
+      if (this.mboxIndex != null) {
+        try {
+          return new ThunderbirdMboxIndexEnumerator(this.mboxIndex,
+                                                    this.folder,
+                                                    this.resumeMark);
+        } catch (IOException) {
+          // The index went away, so we fall back to scanning.
+        }
+      }
       return new ThunderbirdEmailEnumerator(this.folder);
     }
   }
@@ -25,13 +25,17 @@ namespace Google.Thunderbird {
   internal class ThunderbirdEmailEnumerator : IEnumerator,
                                               IDisposable {
     FileStream fileStream;
-    StreamReader fileReader;
+    ThunderbirdMboxReader mboxReader;
     ThunderbirdFolder folder;
     string currentMessageId;
     bool isRead;
     bool isStarred;
     bool hasFileReadError;
     long currentPositionInFile;
+    // Where the "From - " lines of the current mail and the last mail seen
+    // start.
+    long messageStartPosition;
+    long fromLinePosition;
     long initialMessagePosition;
     long finalMessagePosition;
     int initialFileSeekPosition;
@@ -98,26 +102,15 @@ namespace Google.Thunderbird {
 
           this.fileStream.Seek(this.initialFileSeekPosition, SeekOrigin.Begin);
           this.currentPositionInFile = this.initialFileSeekPosition;
-          this.fileReader = new StreamReader(fileStream, this.encoding);
+          this.mboxReader = ThunderbirdMboxReader.Create(this.fileStream,
+                                                         this.encoding);
           this.carriageReturnSize =
               this.encoding.GetByteCount(ThunderbirdConstants.CarriageReturn);
 
           // Before proceeding with reading the file check if the file reader
           // exists.
           if (!this.hasFileReadError) {
-            // Move the file_reader_ to the first "From - " if it exists.
-            while (this.fileReader.Peek() != -1) {
-              string line = fileReader.ReadLine();
-
-              // We need to add the size of "\r\n" to position depending upon
-              // the current encoding. The line read using ReadLine() does not
-              // include the carriage return, thus we need to add its size also.
-              this.currentPositionInFile +=
-                  (encoding.GetByteCount(line) + this.carriageReturnSize);
-              if (line.StartsWith(ThunderbirdConstants.MboxMailStart)) {
-                break;
-              }
-            }
+            this.MoveToFirstMessage();
           }
         } else {
           this.hasFileReadError = true;
@@ -130,6 +123,39 @@ namespace Google.Thunderbird {
       }
     }
 
+    // Moves the reader past the first "From - " if it exists.
+    void MoveToFirstMessage() {
+      while (!this.mboxReader.IsAtEnd) {
+        this.fromLinePosition = this.currentPositionInFile;
+        // The byte count includes the size of "\r\n" in the current
+        // encoding, as the line breaks are normalized to it.
+        this.currentPositionInFile += this.mboxReader.ReadLine();
+        if (this.mboxReader.LineStartsWith(
+                ThunderbirdConstants.MboxMailStart)) {
+          break;
+        }
+      }
+    }
+
+    internal Encoding Encoding {
+      get {
+        return this.encoding;
+      }
+    }
+
+    internal int CarriageReturnSize {
+      get {
+        return this.carriageReturnSize;
+      }
+    }
+
+    // True if the mbox file could not be read through.
+    internal bool HasFileReadError {
+      get {
+        return this.hasFileReadError;
+      }
+    }
+
     public Object Current {
       get {
         return new ThunderbirdEmailMessage(
@@ -145,81 +171,98 @@ namespace Google.Thunderbird {
     }
 
     public bool MoveNext() {
+      ThunderbirdMsfSummary msfSummary = this.folder.MsfSummary;
+      while (this.MoveToNextMessage()) {
+        // Skip the mails Thunderbird has deleted without marking them so in
+        // the mbox.
+        if (msfSummary == null ||
+            !msfSummary.IsExpunged(this.messageStartPosition,
+                                   this.currentMessageId)) {
+          return true;
+        }
+      }
+      return false;
+    }
+
+    bool MoveToNextMessage() {
       if (this.hasFileReadError) {
         return false;
       }
 
       try {
+        ThunderbirdMboxReader mboxReader = this.mboxReader;
+        this.messageStartPosition = this.fromLinePosition;
+
         // From - is not a part of rfc822. This initialization should take care 
         // of it
         this.initialMessagePosition = this.currentPositionInFile;
 
         // Check for the end of stream. Return false if we hit it.
-        if (this.fileReader.Peek() == -1) {
+        if (mboxReader.IsAtEnd) {
           return false;
         }
 
-        while (this.fileReader.Peek() != -1) {
+        while (!mboxReader.IsAtEnd) {
           bool isFirstMessageId = true;
-          string line = this.fileReader.ReadLine();
+          int lineByteCount = mboxReader.ReadLine();
 
           // Consume all the blank lines before we reach the next message or
           // eof.
-          if ((0 == line.Length) && (this.fileReader.Peek() != -1)) {
+          if ((0 == mboxReader.LineLength) && !mboxReader.IsAtEnd) {
             this.currentPositionInFile += this.carriageReturnSize;
             continue;
           }
 
-          this.currentPositionInFile +=
-              encoding.GetByteCount(line) + this.carriageReturnSize;
+          this.currentPositionInFile += lineByteCount;
 
           // If we have reached the eof return false. Also mark the finish
           // offset.
-          if (this.fileReader.Peek() == -1) {
+          if (mboxReader.IsAtEnd) {
             this.finalMessagePosition = this.currentPositionInFile;
             return false;
           }
 
-          while (this.fileReader.Peek() != -1) {
-            line = this.fileReader.ReadLine();
+          while (!mboxReader.IsAtEnd) {
+            lineByteCount = mboxReader.ReadLine();
 
             // See if we have "From - " at the beginning of the line. If it is
             // we have reached the next message. Initialize the end of the
             // current message and exit the loop.
-            if (line.StartsWith(ThunderbirdConstants.MboxMailStart)) {
+            if (mboxReader.LineStartsWith(ThunderbirdConstants.MboxMailStart)) {
               this.finalMessagePosition = this.currentPositionInFile;
+              this.fromLinePosition = this.currentPositionInFile;
 
               // Increment the current position in file as we have not done it.
-              this.currentPositionInFile +=
-                  encoding.GetByteCount(line) + this.carriageReturnSize;
+              this.currentPositionInFile += lineByteCount;
               return true;
             }
 
             // Increment the current position in the file.
-            this.currentPositionInFile +=
-                encoding.GetByteCount(line) + this.carriageReturnSize;
+            this.currentPositionInFile += lineByteCount;
 
             // If we find the message-id of the current message, populate the
             // variable message_id_.
             if (isFirstMessageId &&
-                line.ToLower().StartsWith(
+                mboxReader.LineStartsWithIgnoreCase(
                     ThunderbirdConstants.MessageIDStart)) {
               int endingIndex =
-                  line.IndexOf(ThunderbirdConstants.MessageIDEnd);
-              string messageId = line.Substring(
-                  ThunderbirdConstants.MessageIdLen,
-                  endingIndex - ThunderbirdConstants.MessageIdLen);
-              this.currentMessageId = messageId;
-              isFirstMessageId = false;
+                  mboxReader.LineIndexOf(ThunderbirdConstants.MessageIDEnd[0]);
+              if (endingIndex >= ThunderbirdConstants.MessageIdLen) {
+                this.currentMessageId = mboxReader.GetLineText(
+                    ThunderbirdConstants.MessageIdLen,
+                    endingIndex - ThunderbirdConstants.MessageIdLen);
+                isFirstMessageId = false;
+              }
             }
 
             // If we find X-Mozilla-Status, set up the flags.
-            if (line.StartsWith(ThunderbirdConstants.XMozillaStatus)) {
+            if (mboxReader.LineStartsWith(
+                    ThunderbirdConstants.XMozillaStatus)) {
               int xMozillaStatusLen =
                   ThunderbirdConstants.XMozillaStatus.Length;
-              string status = line.Substring(
+              string status = mboxReader.GetLineText(
                   xMozillaStatusLen - 1,
-                  line.Length - xMozillaStatusLen + 1);
+                  mboxReader.LineLength - xMozillaStatusLen + 1);
               int statusNum = 0;
               try {
                 statusNum = int.Parse(status, NumberStyles.HexNumber);
@@ -241,19 +284,19 @@ namespace Google.Thunderbird {
               // "From - ".
               int deleted = statusNum & 0x0008;
               if (deleted > 0) {
-                while (this.fileReader.Peek() != -1) {
+                while (!mboxReader.IsAtEnd) {
                   isFirstMessageId = false;
-                  line = this.fileReader.ReadLine();
-                  this.currentPositionInFile +=
-                      encoding.GetByteCount(line) + this.carriageReturnSize;
-                  if (line.IndexOf(
-                      ThunderbirdConstants.MboxMailStart) == 0) {
+                  this.fromLinePosition = this.currentPositionInFile;
+                  this.currentPositionInFile += mboxReader.ReadLine();
+                  if (mboxReader.LineStartsWith(
+                          ThunderbirdConstants.MboxMailStart)) {
+                    this.messageStartPosition = this.fromLinePosition;
                     this.initialMessagePosition = this.currentPositionInFile;
                     break;
                   }
                 }
 
-                if (this.fileReader.Peek() == -1) {
+                if (mboxReader.IsAtEnd) {
                   return false;
                 }
               }
@@ -275,26 +318,21 @@ namespace Google.Thunderbird {
 
     public void Reset() {
       try {
-        this.fileReader.Close();
+        this.mboxReader.Dispose();
         this.fileStream.Close();
 
         this.currentPositionInFile = 0;
+        this.messageStartPosition = 0;
+        this.fromLinePosition = 0;
         this.initialMessagePosition = 0;
         this.finalMessagePosition = 0;
         this.hasFileReadError = false;
 
         this.fileStream = File.OpenRead(this.folder.FolderPath);
         this.fileStream.Seek(this.initialFileSeekPosition, SeekOrigin.Begin);
-        this.fileReader = new StreamReader(fileStream, this.encoding);
-
-        while (this.fileReader.Peek() != -1) {
-          string line = fileReader.ReadLine();
-          this.currentPositionInFile +=
-              encoding.GetByteCount(line) + this.carriageReturnSize;
-          if (0 == line.IndexOf(ThunderbirdConstants.MboxMailStart)) {
-            break;
-          }
-        }
+        this.mboxReader = ThunderbirdMboxReader.Create(this.fileStream,
+                                                       this.encoding);
+        this.MoveToFirstMessage();
       } catch {
         // There might be 2 reasons for the program to come here.
         // 1. The file does not exist.
@@ -305,8 +343,12 @@ namespace Google.Thunderbird {
     }
 
     public void Dispose() {
-      this.fileReader.Close();
-      this.fileStream.Close();
+      if (this.mboxReader != null) {
+        this.mboxReader.Dispose();
+      }
+      if (this.fileStream != null) {
+        this.fileStream.Close();
+      }
     }
   }
 }
\ No newline at end of file
@@ -18,9 +18,11 @@ using System.IO;
 using System.Text;
 
 using Google.MailClientInterfaces;
+using GoogleEmailUploader;
 
 namespace Google.Thunderbird {
-  internal class ThunderbirdEmailMessage : IMail {
+  internal class ThunderbirdEmailMessage : IMail,
+                                          IResumableMail {
     long initialMessagePosition;
     long finalMessagePosition;
     ThunderbirdFolder folder;
@@ -82,6 +84,24 @@ namespace Google.Thunderbird {
       }
     }
 
+    public string ResumeMark {
+      get {
+        return ThunderbirdMboxIndex.GetResumeMark(this);
+      }
+    }
+
+    internal long InitialMessagePosition {
+      get {
+        return this.initialMessagePosition;
+      }
+    }
+
+    internal long FinalMessagePosition {
+      get {
+        return this.finalMessagePosition;
+      }
+    }
+
     public void Dispose() {
     }
 
@@ -143,5 +163,115 @@ namespace Google.Thunderbird {
         return this.message;
       }
     }
+
+    public Stream OpenRfc822Stream() {
+      if (this.message == null &&
+          (this.encoding is ASCIIEncoding || this.encoding is UTF8Encoding)) {
+        Stream sliceStream = this.OpenSliceStream();
+        if (sliceStream != null) {
+          return sliceStream;
+        }
+      }
+      // The mbox lines are normalized to CRLF while reading, so the message
+      // has to be read in before it can be served.
+      return new MemoryStream(this.Rfc822Buffer, false);
+    }
+
+    // Returns a stream straight over the message in the mbox file if its
+    // bytes are what Rfc822Buffer would return. That is the case when all
+    // the lines end in CRLF, all the characters are 7 bit so decoding does
+    // not change them and the mandatory fields are present. Returns null
+    // otherwise.
+    Stream OpenSliceStream() {
+      int windowSize = GoogleEmailUploaderConfig.MboxReadWindowSize;
+      ThunderbirdMboxSliceStream sliceStream = null;
+      try {
+        sliceStream =
+            new ThunderbirdMboxSliceStream(this.folder.FolderPath,
+                                           this.initialMessagePosition,
+                                           this.messageSize,
+                                           windowSize);
+        if (ThunderbirdEmailMessage.IsVerbatimMessage(sliceStream,
+                                                      windowSize)) {
+          sliceStream.Position = 0;
+          // The mail may wait in the queue of the mail reader for a while,
+          // and the number of open files should not grow with the queue.
+          sliceStream.CloseFile();
+          return sliceStream;
+        }
+      } catch (IOException) {
+        // Rfc822Buffer deals with the failure.
+      }
+      if (sliceStream != null) {
+        sliceStream.Close();
+      }
+      return null;
+    }
+
+    static bool IsVerbatimMessage(Stream sliceStream,
+                                  int windowSize) {
+      byte[] window = new byte[windowSize];
+      byte[] fromField =
+          Encoding.ASCII.GetBytes(ThunderbirdConstants.MandatoryFromField);
+      byte[] dateField =
+          Encoding.ASCII.GetBytes(ThunderbirdConstants.MandatoryDateField);
+      bool hasFromField = false;
+      bool hasDateField = false;
+      // Whether the start of the current line still matches the fields.
+      bool isFromFieldLine = true;
+      bool isDateFieldLine = true;
+      int lineOffset = 0;
+      bool isAfterCarriageReturn = false;
+      byte lastByte = 0;
+      long remaining = sliceStream.Length;
+      while (remaining > 0) {
+        int readCount = sliceStream.Read(
+            window,
+            0,
+            (int)Math.Min(window.Length, remaining));
+        if (readCount <= 0) {
+          // The mbox file got shorter.
+          return false;
+        }
+        remaining -= readCount;
+        for (int i = 0; i < readCount; ++i) {
+          byte b = window[i];
+          if (isAfterCarriageReturn) {
+            if (b != '\n') {
+              return false;
+            }
+            isAfterCarriageReturn = false;
+            isFromFieldLine = true;
+            isDateFieldLine = true;
+            lineOffset = 0;
+            continue;
+          }
+          if (b == '\r') {
+            isAfterCarriageReturn = true;
+            continue;
+          }
+          if (b == '\n' || b >= 0x80) {
+            return false;
+          }
+          if (isFromFieldLine) {
+            isFromFieldLine = lineOffset < fromField.Length &&
+                              b == fromField[lineOffset];
+            if (isFromFieldLine && lineOffset + 1 == fromField.Length) {
+              hasFromField = true;
+            }
+          }
+          if (isDateFieldLine) {
+            isDateFieldLine = lineOffset < dateField.Length &&
+                              b == dateField[lineOffset];
+            if (isDateFieldLine && lineOffset + 1 == dateField.Length) {
+              hasDateField = true;
+            }
+          }
+          lineOffset++;
+        }
+        lastByte = window[readCount - 1];
+      }
+      return lastByte == '\n' && hasFromField && hasDateField;
+    }
   }
 }
\ No newline at end of file
@@ -22,7 +22,8 @@ using Google.MailClientInterfaces;
 using System.Globalization;
 
 namespace Google.Thunderbird {
-  internal class ThunderbirdFolder : IFolder {
+  internal class ThunderbirdFolder : IFolder,
+                                     IResumableFolder {
     string folderPath;
     string name;
     uint messageCount;
@@ -30,6 +31,7 @@ namespace Google.Thunderbird {
     IFolder parentFolder;
     IStore store;
     ArrayList subFolders;
+    ThunderbirdMsfSummary msfSummary;
 
     internal ThunderbirdFolder(FolderKind folderKind,
                                string name,
@@ -42,6 +44,7 @@ namespace Google.Thunderbird {
       this.parentFolder = parentFolder;
       this.store = clientStore;
 
+      this.msfSummary = ThunderbirdMsfSummary.Load(folderPath);
       this.messageCount = this.CountEmails();
       this.subFolders = new ArrayList();
       this.PopulateFolder();
@@ -85,33 +88,79 @@ namespace Google.Thunderbird {
 
     public IEnumerable Mails {
       get {
-        return new ThunderbirdEmailEnumerable(this);
+        return new ThunderbirdEmailEnumerable(this,
+                                              this.GetMboxIndex(),
+                                              null);
       }
     }
 
+    public IEnumerable GetMailsFrom(string resumeMark) {
+      return new ThunderbirdEmailEnumerable(this,
+                                            this.GetMboxIndex(),
+                                            resumeMark);
+    }
+
     public string FolderPath {
       get {
         return this.folderPath;
       }
     }
 
+    // The summary from the .msf file, or null if it is missing or stale.
+    internal ThunderbirdMsfSummary MsfSummary {
+      get {
+        return this.msfSummary;
+      }
+    }
+
+    // Returns the index of the mbox file, building it if the file changed
+    // since it was last indexed. Returns null if there is no index.
+    private ThunderbirdMboxIndex GetMboxIndex() {
+      ThunderbirdMboxIndex mboxIndex =
+          ThunderbirdMboxIndex.Load(this.folderPath);
+      if (mboxIndex == null) {
+        mboxIndex = ThunderbirdMboxIndex.Build(this);
+      }
+      return mboxIndex;
+    }
+
     private uint CountEmails() {
+      ThunderbirdMboxIndex mboxIndex =
+          ThunderbirdMboxIndex.Load(this.folderPath);
+      if (mboxIndex != null) {
+        return mboxIndex.MailCount;
+      }
+
+      // Take the count from the .msf file if it is up to date, and leave
+      // building the index to when the mails are enumerated.
+      if (this.msfSummary != null) {
+        return this.msfSummary.MailCount;
+      }
+
+      mboxIndex = ThunderbirdMboxIndex.Build(this);
+      if (mboxIndex != null) {
+        return mboxIndex.MailCount;
+      }
+
       uint numEmails = 0;
       try {
-        using (StreamReader fileReader = new StreamReader(folderPath)) {
-          while (fileReader.Peek() != -1) {
-            string line = fileReader.ReadLine();
-            if (0 == line.IndexOf(ThunderbirdConstants.MboxMailStart)) {
+        using (FileStream fileStream = File.OpenRead(folderPath)) {
+          ThunderbirdMboxReader mboxReader =
+              ThunderbirdMboxReader.Create(fileStream);
+          while (!mboxReader.IsAtEnd) {
+            mboxReader.ReadLine();
+            if (mboxReader.LineStartsWith(ThunderbirdConstants.MboxMailStart)) {
               ++numEmails;
             }
 
             // Check if the message has been expunged from the mailbox.
-            if (line.StartsWith(ThunderbirdConstants.XMozillaStatus)) {
+            if (mboxReader.LineStartsWith(
+                    ThunderbirdConstants.XMozillaStatus)) {
               int xMozillaStatusLen =
                   ThunderbirdConstants.XMozillaStatus.Length;
-              string status = line.Substring(
+              string status = mboxReader.GetLineText(
                   xMozillaStatusLen - 1,
-                  line.Length - xMozillaStatusLen + 1);
+                  mboxReader.LineLength - xMozillaStatusLen + 1);
               int statusNum = 0;
               try {
                 statusNum = int.Parse(status, NumberStyles.HexNumber);
@@ -0,0 +1,42 @@
+// Copyright 2007 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+//
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+using System;
+using System.Collections;
+
+using Google.MailClientInterfaces;
+
+namespace Google.Thunderbird {
+  /// <summary>
+  /// Session of a mail reader thread on a ThunderbirdStore. Each folder is an
+  /// mbox file of its own, and every enumeration opens the file afresh, so
+  /// the session has no state of its own. The files open at any time are the
+  /// mbox and index files of the folders being read, one of each per reader
+  /// thread.
+  /// </summary>
+  internal class ThunderbirdMailSession : IMailSession {
+    public IEnumerable GetMails(IFolder folder,
+                                string resumeMark) {
+      ThunderbirdFolder thunderbirdFolder = (ThunderbirdFolder)folder;
+      if (resumeMark != null) {
+        return thunderbirdFolder.GetMailsFrom(resumeMark);
+      }
+      return thunderbirdFolder.Mails;
+    }
+
+    public void Dispose() {
+    }
+  }
+}
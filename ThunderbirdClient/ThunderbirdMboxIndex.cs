@@ -0,0 +1,415 @@
+// Copyright 2007 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+//
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+using System;
+using System.Collections;
+using System.IO;
+using System.Text;
+
+namespace Google.Thunderbird {
+  /// <summary>
+  /// Index of the mails of an mbox file, kept in a file of its own under the
+  /// local application data. It records where each mail starts and ends
+  /// along with its id and flags, as found by ThunderbirdEmailEnumerator.
+  /// The index is valid as long as the size and the last write time of the
+  /// mbox file are the ones recorded in it. With it the folder is counted
+  /// and enumerated without scanning the mbox, and an upload that is resumed
+  /// starts right at the first mail that was not processed.
+  /// </summary>
+  internal class ThunderbirdMboxIndex {
+    // Bump this when the layout of the index file changes.
+    const int FormatVersion = 1;
+    const byte ReadFlag = 0x01;
+    const byte StarredFlag = 0x02;
+    const byte HasMailIdFlag = 0x04;
+    // A resume mark is the start of the mail in 16 hex digits followed by
+    // the hash of its id and size in 8 hex digits, so the marks of a folder
+    // compare in the order of the mails.
+    const int ResumeMarkPositionLength = 16;
+    const int ResumeMarkLength = 24;
+
+    string indexPath;
+    // The offset of the first entry in the index file.
+    long entriesPosition;
+    uint mailCount;
+    Encoding encoding;
+    int carriageReturnSize;
+
+    ThunderbirdMboxIndex(string indexPath,
+                         long entriesPosition,
+                         uint mailCount,
+                         Encoding encoding,
+                         int carriageReturnSize) {
+      this.indexPath = indexPath;
+      this.entriesPosition = entriesPosition;
+      this.mailCount = mailCount;
+      this.encoding = encoding;
+      this.carriageReturnSize = carriageReturnSize;
+    }
+
+    internal uint MailCount {
+      get {
+        return this.mailCount;
+      }
+    }
+
+    internal string IndexPath {
+      get {
+        return this.indexPath;
+      }
+    }
+
+    internal long EntriesPosition {
+      get {
+        return this.entriesPosition;
+      }
+    }
+
+    internal Encoding Encoding {
+      get {
+        return this.encoding;
+      }
+    }
+
+    internal int CarriageReturnSize {
+      get {
+        return this.carriageReturnSize;
+      }
+    }
+
+    static string GetIndexPath(string mboxPath) {
+      string indexDirectory =
+          Path.Combine(
+              Environment.GetFolderPath(
+                  Environment.SpecialFolder.LocalApplicationData),
+              ThunderbirdConstants.MboxIndexDirectory);
+      // 64 bit FNV-1a of the path. MD5 is not available where the FIPS
+      // policy is enforced.
+      ulong pathHash = 14695981039346656037;
+      foreach (char c in Path.GetFullPath(mboxPath).ToLower()) {
+        pathHash = (pathHash ^ c) * 1099511628211;
+      }
+      return Path.Combine(indexDirectory, pathHash.ToString("x16"));
+    }
+
+    /// <summary>
+    /// Returns the index of the mbox file if there is a valid one, null
+    /// otherwise.
+    /// </summary>
+    internal static ThunderbirdMboxIndex Load(string mboxPath) {
+      try {
+        FileInfo mboxFileInfo = new FileInfo(mboxPath);
+        string indexPath = ThunderbirdMboxIndex.GetIndexPath(mboxPath);
+        if (!mboxFileInfo.Exists || !File.Exists(indexPath)) {
+          return null;
+        }
+        using (FileStream indexStream = File.OpenRead(indexPath)) {
+          BinaryReader indexReader = new BinaryReader(indexStream);
+          if (indexReader.ReadInt32() != ThunderbirdMboxIndex.FormatVersion) {
+            return null;
+          }
+          string indexedMboxPath = indexReader.ReadString();
+          long mboxLength = indexReader.ReadInt64();
+          long mboxLastWriteTime = indexReader.ReadInt64();
+          int codePage = indexReader.ReadInt32();
+          int carriageReturnSize = indexReader.ReadInt32();
+          uint mailCount = indexReader.ReadUInt32();
+          if (string.Compare(indexedMboxPath,
+                             Path.GetFullPath(mboxPath),
+                             true) != 0 ||
+              mboxLength != mboxFileInfo.Length ||
+              mboxLastWriteTime != mboxFileInfo.LastWriteTimeUtc.Ticks) {
+            return null;
+          }
+          return new ThunderbirdMboxIndex(indexPath,
+                                          indexStream.Position,
+                                          mailCount,
+                                          Encoding.GetEncoding(codePage),
+                                          carriageReturnSize);
+        }
+      } catch (Exception) {
+        // A missing or broken index is built again.
+        return null;
+      }
+    }
+
+    /// <summary>
+    /// Scans the mbox file and saves the index. Returns null if the file
+    /// could not be read, changed while it was scanned or the index could
+    /// not be saved.
+    /// </summary>
+    internal static ThunderbirdMboxIndex Build(ThunderbirdFolder folder) {
+      string mboxPath = folder.FolderPath;
+      string indexPath = ThunderbirdMboxIndex.GetIndexPath(mboxPath);
+      string tempIndexPath = indexPath + ".tmp";
+      try {
+        FileInfo mboxFileInfo = new FileInfo(mboxPath);
+        if (!mboxFileInfo.Exists) {
+          return null;
+        }
+        long mboxLength = mboxFileInfo.Length;
+        long mboxLastWriteTime = mboxFileInfo.LastWriteTimeUtc.Ticks;
+        Directory.CreateDirectory(Path.GetDirectoryName(indexPath));
+
+        ThunderbirdEmailEnumerator mailEnumerator =
+            new ThunderbirdEmailEnumerator(folder);
+        uint mailCount = 0;
+        long entriesPosition;
+        try {
+          using (FileStream indexStream =
+              new FileStream(tempIndexPath,
+                             FileMode.Create,
+                             FileAccess.Write,
+                             FileShare.None)) {
+            BinaryWriter indexWriter = new BinaryWriter(indexStream);
+            indexWriter.Write(ThunderbirdMboxIndex.FormatVersion);
+            indexWriter.Write(Path.GetFullPath(mboxPath));
+            indexWriter.Write(mboxLength);
+            indexWriter.Write(mboxLastWriteTime);
+            indexWriter.Write(mailEnumerator.Encoding.CodePage);
+            indexWriter.Write(mailEnumerator.CarriageReturnSize);
+            // The count is filled in once the mails are written.
+            long mailCountPosition = indexStream.Position;
+            indexWriter.Write(mailCount);
+            entriesPosition = indexStream.Position;
+            while (mailEnumerator.MoveNext()) {
+              ThunderbirdEmailMessage message =
+                  (ThunderbirdEmailMessage)mailEnumerator.Current;
+              ThunderbirdMboxIndex.WriteEntry(indexWriter, message);
+              mailCount++;
+            }
+            indexWriter.Flush();
+            indexStream.Seek(mailCountPosition, SeekOrigin.Begin);
+            indexWriter.Write(mailCount);
+            indexWriter.Flush();
+          }
+        } finally {
+          mailEnumerator.Dispose();
+        }
+        mboxFileInfo.Refresh();
+        if (mailEnumerator.HasFileReadError ||
+            mboxFileInfo.Length != mboxLength ||
+            mboxFileInfo.LastWriteTimeUtc.Ticks != mboxLastWriteTime) {
+          File.Delete(tempIndexPath);
+          return null;
+        }
+        if (File.Exists(indexPath)) {
+          File.Delete(indexPath);
+        }
+        File.Move(tempIndexPath, indexPath);
+        return new ThunderbirdMboxIndex(indexPath,
+                                        entriesPosition,
+                                        mailCount,
+                                        mailEnumerator.Encoding,
+                                        mailEnumerator.CarriageReturnSize);
+      } catch (Exception) {
+        // We can do without the index. The folder is then scanned as the
+        // mails are enumerated.
+        try {
+          File.Delete(tempIndexPath);
+        } catch (Exception) {
+        }
+        return null;
+      }
+    }
+
+    static void WriteEntry(BinaryWriter indexWriter,
+                           ThunderbirdEmailMessage message) {
+      byte flags = 0;
+      if (message.IsRead) {
+        flags |= ThunderbirdMboxIndex.ReadFlag;
+      }
+      if (message.IsStarred) {
+        flags |= ThunderbirdMboxIndex.StarredFlag;
+      }
+      if (message.MailId != null) {
+        flags |= ThunderbirdMboxIndex.HasMailIdFlag;
+      }
+      indexWriter.Write(message.InitialMessagePosition);
+      indexWriter.Write(message.FinalMessagePosition);
+      indexWriter.Write(flags);
+      if (message.MailId != null) {
+        indexWriter.Write(message.MailId);
+      }
+    }
+
+    /// <summary>
+    /// Reads the next mail from the entries of the index.
+    /// </summary>
+    internal ThunderbirdEmailMessage ReadEntry(BinaryReader indexReader,
+                                               ThunderbirdFolder folder) {
+      long initialMessagePosition = indexReader.ReadInt64();
+      long finalMessagePosition = indexReader.ReadInt64();
+      byte flags = indexReader.ReadByte();
+      string mailId = null;
+      if ((flags & ThunderbirdMboxIndex.HasMailIdFlag) != 0) {
+        mailId = indexReader.ReadString();
+      }
+      return new ThunderbirdEmailMessage(
+          folder,
+          mailId,
+          (flags & ThunderbirdMboxIndex.ReadFlag) != 0,
+          (flags & ThunderbirdMboxIndex.StarredFlag) != 0,
+          initialMessagePosition,
+          finalMessagePosition,
+          this.encoding,
+          this.carriageReturnSize);
+    }
+
+    static uint GetMailHash(ThunderbirdEmailMessage message) {
+      // FNV-1a, as the hash has to be the same across runs and versions of
+      // the framework.
+      uint hash = 2166136261;
+      if (message.MailId != null) {
+        foreach (char c in message.MailId) {
+          hash = (hash ^ c) * 16777619;
+        }
+      }
+      uint messageSize = message.MessageSize;
+      for (int i = 0; i < 4; ++i) {
+        hash = (hash ^ (messageSize & 0xFF)) * 16777619;
+        messageSize >>= 8;
+      }
+      return hash;
+    }
+
+    internal static string GetResumeMark(ThunderbirdEmailMessage message) {
+      return message.InitialMessagePosition.ToString("X16") +
+          ThunderbirdMboxIndex.GetMailHash(message).ToString("X8");
+    }
+
+    /// <summary>
+    /// Returns false if the resume mark was not given out by GetResumeMark.
+    /// </summary>
+    internal static bool ParseResumeMark(string resumeMark,
+                                         out long initialMessagePosition,
+                                         out uint mailHash) {
+      initialMessagePosition = 0;
+      mailHash = 0;
+      if (resumeMark == null ||
+          resumeMark.Length != ThunderbirdMboxIndex.ResumeMarkLength) {
+        return false;
+      }
+      try {
+        initialMessagePosition = long.Parse(
+            resumeMark.Substring(
+                0,
+                ThunderbirdMboxIndex.ResumeMarkPositionLength),
+            System.Globalization.NumberStyles.HexNumber);
+        mailHash = uint.Parse(
+            resumeMark.Substring(
+                ThunderbirdMboxIndex.ResumeMarkPositionLength),
+            System.Globalization.NumberStyles.HexNumber);
+      } catch {
+        return false;
+      }
+      return true;
+    }
+
+    /// <summary>
+    /// True if the mail is the one the resume mark was given out for.
+    /// </summary>
+    internal static bool IsMarkedMail(ThunderbirdEmailMessage message,
+                                      long initialMessagePosition,
+                                      uint mailHash) {
+      return message.InitialMessagePosition == initialMessagePosition &&
+             ThunderbirdMboxIndex.GetMailHash(message) == mailHash;
+    }
+  }
+
+  /// <summary>
+  /// Enumerates the mails of a folder from its index. Given a resume mark it
+  /// skips the mails before the marked one. If the marked mail is no longer
+  /// where it was, say because Thunderbird compacted the folder, all the
+  /// mails are enumerated.
+  /// </summary>
+  internal class ThunderbirdMboxIndexEnumerator : IEnumerator,
+                                                  IDisposable {
+    ThunderbirdMboxIndex mboxIndex;
+    ThunderbirdFolder folder;
+    FileStream indexStream;
+    BinaryReader indexReader;
+    uint readCount;
+    ThunderbirdEmailMessage currentMessage;
+    bool hasResumeMark;
+    long resumePosition;
+    uint resumeMailHash;
+
+    internal ThunderbirdMboxIndexEnumerator(ThunderbirdMboxIndex mboxIndex,
+                                            ThunderbirdFolder folder,
+                                            string resumeMark) {
+      this.mboxIndex = mboxIndex;
+      this.folder = folder;
+      this.hasResumeMark =
+          ThunderbirdMboxIndex.ParseResumeMark(resumeMark,
+                                               out this.resumePosition,
+                                               out this.resumeMailHash);
+      this.Open();
+    }
+
+    void Open() {
+      this.indexStream = File.OpenRead(this.mboxIndex.IndexPath);
+      this.indexStream.Seek(this.mboxIndex.EntriesPosition, SeekOrigin.Begin);
+      this.indexReader = new BinaryReader(this.indexStream);
+      this.readCount = 0;
+      this.currentMessage = null;
+    }
+
+    public Object Current {
+      get {
+        return this.currentMessage;
+      }
+    }
+
+    ThunderbirdEmailMessage ReadNextMessage() {
+      if (this.readCount >= this.mboxIndex.MailCount) {
+        return null;
+      }
+      this.readCount++;
+      return this.mboxIndex.ReadEntry(this.indexReader, this.folder);
+    }
+
+    public bool MoveNext() {
+      this.currentMessage = this.ReadNextMessage();
+      if (this.hasResumeMark) {
+        this.hasResumeMark = false;
+        while (this.currentMessage != null &&
+               this.currentMessage.InitialMessagePosition <
+                   this.resumePosition) {
+          this.currentMessage = this.ReadNextMessage();
+        }
+        if (this.currentMessage == null ||
+            !ThunderbirdMboxIndex.IsMarkedMail(this.currentMessage,
+                                               this.resumePosition,
+                                               this.resumeMailHash)) {
+          // The mbox changed under the mark, so we go through all the mails
+          // and let the uploaded mail ids sort them out.
+          this.Reset();
+          this.currentMessage = this.ReadNextMessage();
+        }
+      }
+      return this.currentMessage != null;
+    }
+
+    public void Reset() {
+      this.indexStream.Close();
+      this.Open();
+    }
+
+    public void Dispose() {
+      this.indexStream.Close();
+    }
+  }
+}
@@ -0,0 +1,324 @@
+// Copyright 2007 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+//
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+using System;
+using System.IO;
+using System.Text;
+
+namespace Google.Thunderbird {
+  /// <summary>
+  /// Reads an mbox file line by line for ThunderbirdEmailEnumerator. The
+  /// byte count of a line is that of its text followed by a CRLF in the
+  /// encoding of the file, whatever the line actually ends with. This is
+  /// how ThunderbirdEmailMessage counts the lines of the message.
+  /// </summary>
+  internal abstract class ThunderbirdMboxReader : IDisposable {
+    /// <summary>
+    /// Creates the reader for the stream positioned after the byte order
+    /// mark. Files in encodings where a line break is a single byte are
+    /// scanned as bytes, which saves decoding the lines that are not looked
+    /// at.
+    /// </summary>
+    internal static ThunderbirdMboxReader Create(Stream stream,
+                                                 Encoding encoding) {
+      if (encoding is ASCIIEncoding || encoding is UTF8Encoding) {
+        return new ThunderbirdMboxByteReader(stream, encoding);
+      }
+      return new ThunderbirdMboxTextReader(stream, encoding);
+    }
+
+    /// <summary>
+    /// Creates the reader for the stream at its start, detecting the encoding
+    /// from the byte order mark the way StreamReader does. UTF-8 is assumed
+    /// if there is no byte order mark.
+    /// </summary>
+    internal static ThunderbirdMboxReader Create(Stream stream) {
+      byte[] bom = new byte[3];
+      int bomLength = stream.Read(bom, 0, bom.Length);
+      if (bomLength == 3 &&
+          bom[0] == 0xef && bom[1] == 0xbb && bom[2] == 0xbf) {
+        return new ThunderbirdMboxByteReader(stream, Encoding.UTF8);
+      }
+      stream.Seek(0, SeekOrigin.Begin);
+      if (bomLength >= 2 &&
+          ((bom[0] == 0xff && bom[1] == 0xfe) ||
+           (bom[0] == 0xfe && bom[1] == 0xff))) {
+        // StreamReader skips the byte order mark and picks the encoding.
+        return new ThunderbirdMboxTextReader(stream, Encoding.UTF8);
+      }
+      return new ThunderbirdMboxByteReader(stream, Encoding.UTF8);
+    }
+
+    /// <summary>
+    /// True if there are no more lines to read.
+    /// </summary>
+    internal abstract bool IsAtEnd {
+      get;
+    }
+
+    /// <summary>
+    /// Moves to the next line and returns its byte count.
+    /// </summary>
+    internal abstract int ReadLine();
+
+    /// <summary>
+    /// Length of the current line. The indices taken by the methods below are
+    /// in the same units.
+    /// </summary>
+    internal abstract int LineLength {
+      get;
+    }
+
+    internal abstract bool LineStartsWith(string prefix);
+
+    /// <summary>
+    /// Compares the line with the prefix, which should be in lower case,
+    /// ignoring the case of the line.
+    /// </summary>
+    internal abstract bool LineStartsWithIgnoreCase(string lowerCasePrefix);
+
+    internal abstract int LineIndexOf(char value);
+
+    internal abstract string GetLineText(int startIndex,
+                                         int length);
+
+    public abstract void Dispose();
+  }
+
+  /// <summary>
+  /// Reads the lines as strings. Used for the encodings in which a line break
+  /// takes more than one byte.
+  /// </summary>
+  internal class ThunderbirdMboxTextReader : ThunderbirdMboxReader {
+    StreamReader streamReader;
+    Encoding encoding;
+    int carriageReturnSize;
+    string line;
+
+    internal ThunderbirdMboxTextReader(Stream stream,
+                                       Encoding encoding) {
+      this.streamReader = new StreamReader(stream, encoding);
+      this.encoding = encoding;
+      this.carriageReturnSize =
+          encoding.GetByteCount(ThunderbirdConstants.CarriageReturn);
+      this.line = string.Empty;
+    }
+
+    internal override bool IsAtEnd {
+      get {
+        return this.streamReader.Peek() == -1;
+      }
+    }
+
+    internal override int ReadLine() {
+      this.line = this.streamReader.ReadLine();
+      return this.encoding.GetByteCount(this.line) + this.carriageReturnSize;
+    }
+
+    internal override int LineLength {
+      get {
+        return this.line.Length;
+      }
+    }
+
+    internal override bool LineStartsWith(string prefix) {
+      return this.line.StartsWith(prefix);
+    }
+
+    internal override bool LineStartsWithIgnoreCase(string lowerCasePrefix) {
+      return this.line.ToLower().StartsWith(lowerCasePrefix);
+    }
+
+    internal override int LineIndexOf(char value) {
+      return this.line.IndexOf(value);
+    }
+
+    internal override string GetLineText(int startIndex,
+                                         int length) {
+      return this.line.Substring(startIndex, length);
+    }
+
+    public override void Dispose() {
+      this.streamReader.Close();
+    }
+  }
+
+  /// <summary>
+  /// Reads the file in big blocks and finds the line breaks in the bytes.
+  /// The text of a line is decoded only when it is asked for. The lengths
+  /// and indices are in bytes.
+  /// </summary>
+  internal class ThunderbirdMboxByteReader : ThunderbirdMboxReader {
+    const int InitialBufferSize = 64 * 1024;
+    const int CarriageReturnSize = 2;
+
+    Stream stream;
+    Encoding encoding;
+    byte[] buffer;
+    // The current line starts at lineStart. The bytes from bufferStart to
+    // bufferEnd are not read yet.
+    int lineStart;
+    int lineLength;
+    int bufferStart;
+    int bufferEnd;
+    bool isStreamAtEnd;
+
+    internal ThunderbirdMboxByteReader(Stream stream,
+                                       Encoding encoding) {
+      this.stream = stream;
+      this.encoding = encoding;
+      this.buffer = new byte[ThunderbirdMboxByteReader.InitialBufferSize];
+    }
+
+    // Reads more of the file into the buffer, keeping the current line.
+    // Moves the bytes in the buffer, so the indices are shifted by the old
+    // lineStart. Returns false if there is nothing more to read.
+    bool Fill() {
+      if (this.isStreamAtEnd) {
+        return false;
+      }
+      if (this.lineStart != 0) {
+        Buffer.BlockCopy(this.buffer,
+                         this.lineStart,
+                         this.buffer,
+                         0,
+                         this.bufferEnd - this.lineStart);
+        this.bufferStart -= this.lineStart;
+        this.bufferEnd -= this.lineStart;
+        this.lineStart = 0;
+      }
+      if (this.bufferEnd == this.buffer.Length) {
+        // The line does not fit in the buffer.
+        byte[] newBuffer = new byte[this.buffer.Length * 2];
+        Buffer.BlockCopy(this.buffer,
+                         0,
+                         newBuffer,
+                         0,
+                         this.bufferEnd);
+        this.buffer = newBuffer;
+      }
+      int readCount = this.stream.Read(this.buffer,
+                                       this.bufferEnd,
+                                       this.buffer.Length - this.bufferEnd);
+      if (readCount <= 0) {
+        this.isStreamAtEnd = true;
+        return false;
+      }
+      this.bufferEnd += readCount;
+      return true;
+    }
+
+    internal override bool IsAtEnd {
+      get {
+        if (this.bufferStart < this.bufferEnd) {
+          return false;
+        }
+        return !this.Fill();
+      }
+    }
+
+    internal override int ReadLine() {
+      // Like StreamReader.ReadLine, a line ends with CRLF, LF or CR.
+      this.lineStart = this.bufferStart;
+      int scanOffset = 0;
+      while (true) {
+        byte[] buffer = this.buffer;
+        int scanEnd = this.bufferEnd;
+        for (int i = this.lineStart + scanOffset; i < scanEnd; ++i) {
+          byte b = buffer[i];
+          if (b != '\n' && b != '\r') {
+            continue;
+          }
+          this.lineLength = i - this.lineStart;
+          this.bufferStart = i + 1;
+          if (b == '\r') {
+            if (this.bufferStart == this.bufferEnd) {
+              // We need the next byte to see if it is the LF of a CRLF.
+              this.Fill();
+            }
+            if (this.bufferStart < this.bufferEnd &&
+                this.buffer[this.bufferStart] == '\n') {
+              this.bufferStart++;
+            }
+          }
+          return this.lineLength + ThunderbirdMboxByteReader.CarriageReturnSize;
+        }
+        scanOffset = scanEnd - this.lineStart;
+        if (!this.Fill()) {
+          // The last line of the file does not have a line break.
+          this.lineLength = this.bufferEnd - this.lineStart;
+          this.bufferStart = this.bufferEnd;
+          return this.lineLength + ThunderbirdMboxByteReader.CarriageReturnSize;
+        }
+      }
+    }
+
+    internal override int LineLength {
+      get {
+        return this.lineLength;
+      }
+    }
+
+    internal override bool LineStartsWith(string prefix) {
+      if (this.lineLength < prefix.Length) {
+        return false;
+      }
+      for (int i = 0; i < prefix.Length; ++i) {
+        if (this.buffer[this.lineStart + i] != prefix[i]) {
+          return false;
+        }
+      }
+      return true;
+    }
+
+    internal override bool LineStartsWithIgnoreCase(string lowerCasePrefix) {
+      if (this.lineLength < lowerCasePrefix.Length) {
+        return false;
+      }
+      for (int i = 0; i < lowerCasePrefix.Length; ++i) {
+        int b = this.buffer[this.lineStart + i];
+        if (b >= 'A' && b <= 'Z') {
+          b += 'a' - 'A';
+        }
+        if (b != lowerCasePrefix[i]) {
+          return false;
+        }
+      }
+      return true;
+    }
+
+    internal override int LineIndexOf(char value) {
+      int index = Array.IndexOf(this.buffer,
+                                (byte)value,
+                                this.lineStart,
+                                this.lineLength);
+      if (index == -1) {
+        return -1;
+      }
+      return index - this.lineStart;
+    }
+
+    internal override string GetLineText(int startIndex,
+                                         int length) {
+      return this.encoding.GetString(this.buffer,
+                                     this.lineStart + startIndex,
+                                     length);
+    }
+
+    public override void Dispose() {
+      this.stream.Close();
+    }
+  }
+}
@@ -0,0 +1,164 @@
+// Copyright 2007 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+//
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+using System;
+using System.IO;
+
+namespace Google.Thunderbird {
+  /// <summary>
+  /// Read only stream over a range of bytes of an mbox file. The bytes are
+  /// read from the file as they are asked for, through a buffer of the given
+  /// window size, so a big mail is never held in memory as a whole. The
+  /// file is opened on the first read, and can be let go of with CloseFile
+  /// while the stream waits to be read.
+  /// </summary>
+  internal class ThunderbirdMboxSliceStream : Stream {
+    string mboxPath;
+    int windowSize;
+    // Null while the file is not open.
+    FileStream fileStream;
+    long sliceStart;
+    long sliceLength;
+    long position;
+    bool isClosed;
+
+    internal ThunderbirdMboxSliceStream(string mboxPath,
+                                        long sliceStart,
+                                        long sliceLength,
+                                        int windowSize) {
+      this.mboxPath = mboxPath;
+      this.windowSize = windowSize;
+      this.sliceStart = sliceStart;
+      this.sliceLength = sliceLength;
+    }
+
+    public override bool CanRead {
+      get {
+        return !this.isClosed;
+      }
+    }
+
+    public override bool CanSeek {
+      get {
+        return !this.isClosed;
+      }
+    }
+
+    public override bool CanWrite {
+      get {
+        return false;
+      }
+    }
+
+    public override long Length {
+      get {
+        return this.sliceLength;
+      }
+    }
+
+    public override long Position {
+      get {
+        return this.position;
+      }
+      set {
+        this.Seek(value, SeekOrigin.Begin);
+      }
+    }
+
+    public override int Read(byte[] buffer,
+                             int offset,
+                             int count) {
+      long remaining = this.sliceLength - this.position;
+      if (remaining <= 0) {
+        return 0;
+      }
+      if (count > remaining) {
+        count = (int)remaining;
+      }
+      if (this.fileStream == null) {
+        this.OpenFile();
+      }
+      int readCount = this.fileStream.Read(buffer, offset, count);
+      this.position += readCount;
+      return readCount;
+    }
+
+    public override long Seek(long offset,
+                              SeekOrigin origin) {
+      long newPosition;
+      switch (origin) {
+        case SeekOrigin.Begin:
+          newPosition = offset;
+          break;
+        case SeekOrigin.Current:
+          newPosition = this.position + offset;
+          break;
+        default:
+          newPosition = this.sliceLength + offset;
+          break;
+      }
+      if (newPosition < 0) {
+        throw new IOException("Seek before the start of the mail.");
+      }
+      if (this.fileStream != null) {
+        this.fileStream.Seek(this.sliceStart + newPosition, SeekOrigin.Begin);
+      }
+      this.position = newPosition;
+      return this.position;
+    }
+
+    void OpenFile() {
+      if (this.isClosed) {
+        throw new ObjectDisposedException(null);
+      }
+      // Thunderbird may be appending to the file while we read it.
+      this.fileStream = new FileStream(this.mboxPath,
+                                       FileMode.Open,
+                                       FileAccess.Read,
+                                       FileShare.ReadWrite,
+                                       this.windowSize);
+      this.fileStream.Seek(this.sliceStart + this.position, SeekOrigin.Begin);
+    }
+
+    /// <summary>
+    /// Closes the file till the stream is read again, keeping the position.
+    /// </summary>
+    internal void CloseFile() {
+      if (this.fileStream != null) {
+        this.fileStream.Close();
+        this.fileStream = null;
+      }
+    }
+
+    public override void Flush() {
+    }
+
+    public override void SetLength(long value) {
+      throw new NotSupportedException();
+    }
+
+    public override void Write(byte[] buffer,
+                               int offset,
+                               int count) {
+      throw new NotSupportedException();
+    }
+
+    public override void Close() {
+      this.CloseFile();
+      this.isClosed = true;
+      base.Close();
+    }
+  }
+}
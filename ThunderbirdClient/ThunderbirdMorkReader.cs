@@ -0,0 +1,366 @@
+// Copyright 2007 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+//
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+using System;
+using System.Collections;
+using System.IO;
+using System.Text;
+
+namespace Google.Thunderbird {
+  /// <summary>
+  /// Read only parser for the Mork files Thunderbird keeps its mail summaries
+  /// in (the .msf files). It collects the cells of all the rows, keyed by the
+  /// scope and id of the row, with the column names and the values resolved.
+  /// Table membership and aborted transactions are not tracked, so the rows
+  /// are only as good as the last value written for each cell.
+  /// </summary>
+  internal class ThunderbirdMorkReader {
+    // Mork files are 8 bit text, with anything else escaped.
+    static readonly Encoding MorkEncoding = Encoding.GetEncoding(28591);
+
+    string text;
+    int index;
+    // Maps the ids of the column and the value atoms to their text.
+    Hashtable columnNames;
+    Hashtable atomValues;
+    // Maps the scope name to a hashtable that maps the row id to its cells.
+    // The cells map the column name to the value.
+    Hashtable scopeRows;
+
+    ThunderbirdMorkReader(string text) {
+      this.text = text;
+      this.columnNames = new Hashtable();
+      this.atomValues = new Hashtable();
+      this.scopeRows = new Hashtable();
+    }
+
+    /// <summary>
+    /// Parses the Mork file. Throws IOException if the file can't be read.
+    /// </summary>
+    internal static ThunderbirdMorkReader Parse(string morkPath) {
+      string text;
+      using (StreamReader streamReader =
+          new StreamReader(morkPath, ThunderbirdMorkReader.MorkEncoding)) {
+        text = streamReader.ReadToEnd();
+      }
+      ThunderbirdMorkReader morkReader = new ThunderbirdMorkReader(text);
+      morkReader.ParseContent();
+      return morkReader;
+    }
+
+    /// <summary>
+    /// Returns the rows of the scope as a hashtable that maps the row id to
+    /// a hashtable of its cells, or null if there are no such rows.
+    /// </summary>
+    internal Hashtable GetRows(string scopeName) {
+      return (Hashtable)this.scopeRows[scopeName];
+    }
+
+    bool IsAtEnd {
+      get {
+        return this.index >= this.text.Length;
+      }
+    }
+
+    char PeekChar() {
+      return this.text[this.index];
+    }
+
+    void SkipWhitespaceAndComments() {
+      while (!this.IsAtEnd) {
+        char c = this.PeekChar();
+        if (c == '/' &&
+            this.index + 1 < this.text.Length &&
+            this.text[this.index + 1] == '/') {
+          int lineEnd = this.text.IndexOf('\n', this.index);
+          this.index = lineEnd == -1 ? this.text.Length : lineEnd + 1;
+        } else if (char.IsWhiteSpace(c)) {
+          this.index++;
+        } else {
+          break;
+        }
+      }
+    }
+
+    void ParseContent() {
+      while (true) {
+        this.SkipWhitespaceAndComments();
+        if (this.IsAtEnd) {
+          break;
+        }
+        switch (this.PeekChar()) {
+          case '<':
+            this.ParseDictionary();
+            break;
+          case '{':
+            this.ParseTable();
+            break;
+          case '[':
+            this.ParseRow(string.Empty);
+            break;
+          case '@':
+            this.SkipGroupMarker();
+            break;
+          default:
+            this.index++;
+            break;
+        }
+      }
+    }
+
+    // Group markers look like @$${id{@ and @$$}id}@. We read the content of
+    // the groups as if the markers were not there.
+    void SkipGroupMarker() {
+      string markerEnd = null;
+      if (string.CompareOrdinal(this.text, this.index, "@$${", 0, 4) == 0) {
+        markerEnd = "{@";
+      } else if (string.CompareOrdinal(this.text, this.index, "@$$}", 0, 4) ==
+                     0) {
+        markerEnd = "}@";
+      }
+      if (markerEnd == null) {
+        this.index++;
+        return;
+      }
+      int endIndex = this.text.IndexOf(markerEnd, this.index + 4);
+      this.index = endIndex == -1 ? this.text.Length : endIndex + 2;
+    }
+
+    // Reads up to the next delimiter. Used for ids, scopes and literal column
+    // names.
+    string ReadToken() {
+      int start = this.index;
+      while (!this.IsAtEnd) {
+        char c = this.PeekChar();
+        if (char.IsWhiteSpace(c) ||
+            c == ':' || c == '=' || c == '^' ||
+            c == '(' || c == ')' || c == '[' || c == ']' ||
+            c == '{' || c == '}' || c == '<' || c == '>') {
+          break;
+        }
+        this.index++;
+      }
+      return this.text.Substring(start, this.index - start);
+    }
+
+    // Reads a value up to the closing parenthesis, undoing the escapes.
+    string ReadValue() {
+      StringBuilder value = new StringBuilder();
+      while (!this.IsAtEnd) {
+        char c = this.PeekChar();
+        this.index++;
+        if (c == ')') {
+          break;
+        }
+        if (c == '\\' && !this.IsAtEnd) {
+          c = this.PeekChar();
+          this.index++;
+          if (c == '\r' || c == '\n') {
+            // Line continuation.
+            if (c == '\r' && !this.IsAtEnd && this.PeekChar() == '\n') {
+              this.index++;
+            }
+            continue;
+          }
+          value.Append(c);
+        } else if (c == '$' &&
+                   this.index + 2 <= this.text.Length &&
+                   ThunderbirdMorkReader.IsHexDigit(this.text[this.index]) &&
+                   ThunderbirdMorkReader.IsHexDigit(
+                       this.text[this.index + 1])) {
+          value.Append(
+              (char)Convert.ToInt32(this.text.Substring(this.index, 2), 16));
+          this.index += 2;
+        } else if (c == '\r' || c == '\n') {
+          // Line breaks in values are only there to wrap long lines.
+          continue;
+        } else {
+          value.Append(c);
+        }
+      }
+      return value.ToString();
+    }
+
+    static bool IsHexDigit(char c) {
+      return (c >= '0' && c <= '9') ||
+          (c >= 'a' && c <= 'f') ||
+          (c >= 'A' && c <= 'F');
+    }
+
+    string ResolveColumn(string columnId) {
+      string columnName = (string)this.columnNames[columnId.ToUpper()];
+      return columnName == null ? columnId : columnName;
+    }
+
+    // Resolves the scope of a row or table, which is either a reference to
+    // a column like ^80 or a literal.
+    string ReadScope(string defaultScope) {
+      if (this.IsAtEnd || this.PeekChar() != ':') {
+        return defaultScope;
+      }
+      this.index++;
+      if (!this.IsAtEnd && this.PeekChar() == '^') {
+        this.index++;
+        return this.ResolveColumn(this.ReadToken());
+      }
+      return this.ReadToken();
+    }
+
+    void ParseDictionary() {
+      // Skip the '<'.
+      this.index++;
+      bool isColumnDictionary = false;
+      while (true) {
+        this.SkipWhitespaceAndComments();
+        if (this.IsAtEnd) {
+          return;
+        }
+        char c = this.PeekChar();
+        if (c == '>') {
+          this.index++;
+          return;
+        }
+        if (c == '<') {
+          // Meta dictionary. (a=c) makes this a dictionary of column names.
+          int metaEnd = this.text.IndexOf('>', this.index);
+          if (metaEnd == -1) {
+            metaEnd = this.text.Length - 1;
+          }
+          string meta = this.text.Substring(this.index,
+                                            metaEnd - this.index + 1);
+          if (meta.IndexOf("(a=c)") != -1) {
+            isColumnDictionary = true;
+          }
+          this.index = metaEnd + 1;
+        } else if (c == '(') {
+          this.index++;
+          string id = this.ReadToken().ToUpper();
+          if (!this.IsAtEnd && this.PeekChar() == '=') {
+            this.index++;
+          }
+          string value = this.ReadValue();
+          if (isColumnDictionary) {
+            this.columnNames[id] = value;
+          } else {
+            this.atomValues[id] = value;
+          }
+        } else {
+          this.index++;
+        }
+      }
+    }
+
+    void ParseTable() {
+      // Skip the '{'.
+      this.index++;
+      this.SkipWhitespaceAndComments();
+      if (!this.IsAtEnd && this.PeekChar() == '-') {
+        this.index++;
+      }
+      this.ReadToken();
+      string tableScope = this.ReadScope(string.Empty);
+      while (true) {
+        this.SkipWhitespaceAndComments();
+        if (this.IsAtEnd) {
+          return;
+        }
+        char c = this.PeekChar();
+        if (c == '}') {
+          this.index++;
+          return;
+        }
+        if (c == '{') {
+          // Meta table.
+          int metaEnd = this.text.IndexOf('}', this.index);
+          this.index = metaEnd == -1 ? this.text.Length : metaEnd + 1;
+        } else if (c == '[') {
+          this.ParseRow(tableScope);
+        } else if (c == '@') {
+          this.SkipGroupMarker();
+        } else {
+          // Row references and removals. The rows are read on their own,
+          // so there is nothing to do.
+          this.index++;
+        }
+      }
+    }
+
+    void ParseRow(string defaultScope) {
+      // Skip the '['.
+      this.index++;
+      this.SkipWhitespaceAndComments();
+      bool isCut = false;
+      if (!this.IsAtEnd && this.PeekChar() == '-') {
+        isCut = true;
+        this.index++;
+      }
+      string rowId = this.ReadToken().ToUpper();
+      string rowScope = this.ReadScope(defaultScope);
+      Hashtable rows = (Hashtable)this.scopeRows[rowScope];
+      if (rows == null) {
+        rows = new Hashtable();
+        this.scopeRows[rowScope] = rows;
+      }
+      Hashtable cells = (Hashtable)rows[rowId];
+      if (cells == null || isCut) {
+        cells = new Hashtable();
+        rows[rowId] = cells;
+      }
+      while (true) {
+        this.SkipWhitespaceAndComments();
+        if (this.IsAtEnd) {
+          return;
+        }
+        char c = this.PeekChar();
+        if (c == ']') {
+          this.index++;
+          return;
+        }
+        if (c == '[') {
+          // Row meta.
+          int metaEnd = this.text.IndexOf(']', this.index);
+          this.index = metaEnd == -1 ? this.text.Length : metaEnd + 1;
+        } else if (c == '(') {
+          this.index++;
+          string columnName;
+          if (!this.IsAtEnd && this.PeekChar() == '^') {
+            this.index++;
+            columnName = this.ResolveColumn(this.ReadToken());
+          } else {
+            columnName = this.ReadToken();
+          }
+          string value;
+          if (!this.IsAtEnd && this.PeekChar() == '^') {
+            this.index++;
+            string atomId = this.ReadToken().ToUpper();
+            value = (string)this.atomValues[atomId];
+            // Skip the ')'.
+            this.ReadValue();
+          } else {
+            if (!this.IsAtEnd && this.PeekChar() == '=') {
+              this.index++;
+            }
+            value = this.ReadValue();
+          }
+          if (value != null) {
+            cells[columnName] = value;
+          }
+        } else {
+          this.index++;
+        }
+      }
+    }
+  }
+}
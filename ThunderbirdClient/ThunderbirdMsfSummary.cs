@@ -0,0 +1,158 @@
+// Copyright 2007 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+//
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+using System;
+using System.Collections;
+using System.Globalization;
+using System.IO;
+
+namespace Google.Thunderbird {
+  /// <summary>
+  /// What the .msf file of a folder says about its mbox: the number of mails
+  /// and the mails Thunderbird has deleted. The summary is used only if it
+  /// is up to date with the mbox, that is if the size and the date of the
+  /// mbox recorded in it are the current ones and all the mails it lists lie
+  /// within the mbox. Otherwise the mbox has to be scanned.
+  /// </summary>
+  internal class ThunderbirdMsfSummary {
+    const string FolderInfoScope = "ns:msg:db:row:scope:dbfolderinfo:all";
+    const string MailScope = "ns:msg:db:row:scope:msgs:all";
+    const int ExpungedFlag = 0x0008;
+    static readonly DateTime UnixEpoch = new DateTime(1970, 1, 1);
+
+    uint mailCount;
+    // Maps the offset of the "From - " line of each deleted mail to its id.
+    Hashtable expungedMailIds;
+
+    ThunderbirdMsfSummary(uint mailCount,
+                          Hashtable expungedMailIds) {
+      this.mailCount = mailCount;
+      this.expungedMailIds = expungedMailIds;
+    }
+
+    internal uint MailCount {
+      get {
+        return this.mailCount;
+      }
+    }
+
+    /// <summary>
+    /// True if Thunderbird has the mail starting at the offset as deleted.
+    /// The id has to match too, in case the mbox has another mail there.
+    /// </summary>
+    internal bool IsExpunged(long mailPosition,
+                             string mailId) {
+      string expungedMailId = (string)this.expungedMailIds[mailPosition];
+      return expungedMailId != null && expungedMailId == mailId;
+    }
+
+    /// <summary>
+    /// Reads the summary of the mbox from its .msf file. Returns null if
+    /// there is no .msf file, it can't be read or it is stale.
+    /// </summary>
+    internal static ThunderbirdMsfSummary Load(string mboxPath) {
+      try {
+        FileInfo mboxInfo = new FileInfo(mboxPath);
+        string msfPath =
+            mboxPath + ThunderbirdConstants.ThunderbirdMSFExtension;
+        if (!mboxInfo.Exists || !File.Exists(msfPath)) {
+          return null;
+        }
+        ThunderbirdMorkReader morkReader = ThunderbirdMorkReader.Parse(msfPath);
+
+        Hashtable folderInfo =
+            ThunderbirdMsfSummary.GetFirstRow(
+                morkReader.GetRows(ThunderbirdMsfSummary.FolderInfoScope));
+        if (folderInfo == null ||
+            folderInfo["numMsgs"] == null ||
+            folderInfo["folderSize"] == null) {
+          return null;
+        }
+        long folderSize = ThunderbirdMsfSummary.ParseHex(
+            (string)folderInfo["folderSize"]);
+        if (folderSize != mboxInfo.Length) {
+          return null;
+        }
+        string folderDate = (string)folderInfo["folderDate"];
+        if (folderDate != null) {
+          TimeSpan sinceEpoch =
+              mboxInfo.LastWriteTimeUtc - ThunderbirdMsfSummary.UnixEpoch;
+          if (ThunderbirdMsfSummary.ParseHex(folderDate) !=
+                  (long)sinceEpoch.TotalSeconds) {
+            return null;
+          }
+        }
+        uint mailCount =
+            (uint)ThunderbirdMsfSummary.ParseHex((string)folderInfo["numMsgs"]);
+
+        Hashtable expungedMailIds = new Hashtable();
+        Hashtable mailRows =
+            morkReader.GetRows(ThunderbirdMsfSummary.MailScope);
+        if (mailRows != null) {
+          foreach (Hashtable cells in mailRows.Values) {
+            long mailPosition = ThunderbirdMsfSummary.GetMailPosition(cells);
+            if (mailPosition < 0) {
+              continue;
+            }
+            if (mailPosition >= mboxInfo.Length) {
+              // The summary lists a mail the mbox does not have.
+              return null;
+            }
+            string flags = (string)cells["flags"];
+            if (flags != null &&
+                (ThunderbirdMsfSummary.ParseHex(flags) &
+                    ThunderbirdMsfSummary.ExpungedFlag) != 0) {
+              expungedMailIds[mailPosition] = cells["message-id"];
+            }
+          }
+        }
+        return new ThunderbirdMsfSummary(mailCount, expungedMailIds);
+      } catch (Exception) {
+        // A broken summary is no worse than a missing one. The mbox is
+        // scanned instead.
+        return null;
+      }
+    }
+
+    static Hashtable GetFirstRow(Hashtable rows) {
+      if (rows == null) {
+        return null;
+      }
+      foreach (Hashtable cells in rows.Values) {
+        return cells;
+      }
+      return null;
+    }
+
+    // Older versions of Thunderbird keep the offset of the mail in hex in
+    // msgOffset, newer ones in decimal in storeToken. Returns -1 if there is
+    // neither.
+    static long GetMailPosition(Hashtable cells) {
+      string msgOffset = (string)cells["msgOffset"];
+      if (msgOffset != null) {
+        return ThunderbirdMsfSummary.ParseHex(msgOffset);
+      }
+      string storeToken = (string)cells["storeToken"];
+      if (storeToken != null) {
+        return long.Parse(storeToken, NumberStyles.None);
+      }
+      return -1;
+    }
+
+    static long ParseHex(string value) {
+      return long.Parse(value, NumberStyles.HexNumber);
+    }
+  }
+}
@@ -21,7 +21,8 @@ using System.IO;
 using Google.MailClientInterfaces;
 
 namespace Google.Thunderbird {
-  internal class ThunderbirdStore : IStore {
+  internal class ThunderbirdStore : IStore,
+                                    IConcurrentStore {
     ThunderbirdProfile profile;
     IClient client;
     ArrayList folders;
@@ -105,6 +106,10 @@ namespace Google.Thunderbird {
     public void Dispose() {
     }
 
+    public IMailSession OpenMailSession() {
+      return new ThunderbirdMailSession();
+    }
+
     public string StorePath {
       get {
         return this.storePath;
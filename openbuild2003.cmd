@@ -254,6 +254,12 @@ set THUNDERBIRDCLIENT_FILES=^
     ThunderbirdEmailEnumerator.cs^
     ThunderbirdEmailMessage.cs^
     ThunderbirdFolder.cs^
+    ThunderbirdMailSession.cs^
+    ThunderbirdMboxIndex.cs^
+    ThunderbirdMboxReader.cs^
+    ThunderbirdMboxSliceStream.cs^
+    ThunderbirdMorkReader.cs^
+    ThunderbirdMsfSummary.cs^
     ThunderbirdProfile.cs^
     ThunderbirdStore.cs^
     ThunderbirdClient.cs